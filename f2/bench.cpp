@@ -0,0 +1,247 @@
+#include "btree.h"
+#include <chrono>
+#include <cmath>
+#include <random>
+
+// Benchmarks the b-tree operations over a matrix of orders, cell formats,
+// file capacities and key distributions, and prints the results as JSON.
+//
+// Usage: f2_bench [--ops N] [--pool RECORDS] [--mapped] [--async] [--path FILE]
+
+// How the keys of an operation are chosen.
+enum class Distribution { Sequential, Random, Zipfian };
+
+const char* distributionName(Distribution distribution)
+{
+    switch (distribution)
+    {
+        case Distribution::Sequential: return "sequential";
+        case Distribution::Random: return "random";
+        default: return "zipfian";
+    }
+}
+
+// Draws ranks 0..n-1 with probability proportional to 1 / (rank + 1)^theta.
+class ZipfianGenerator {
+private:
+    vector<double> cdf;
+
+public:
+    ZipfianGenerator(int n, double theta)
+    {
+        cdf.resize(n);
+        double sum = 0;
+        for (int i = 0; i < n; ++i) cdf[i] = sum += 1 / pow(i + 1.0, theta);
+        for (double& c: cdf) c /= sum;
+    }
+
+    template <class Engine>
+    int operator()(Engine& engine)
+    {
+        double u = uniform_real_distribution<double>(0, 1)(engine);
+        return min((int) (lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()), (int) cdf.size() - 1);
+    }
+};
+
+// The parameters of one benchmarked b-tree.
+struct BenchConfig {
+    CellFormat format;
+    int m;
+    int cellSize;
+
+    // numberOfRecords as a multiple of the records the keys need.
+    int capacityFactor;
+
+    Distribution distribution;
+};
+
+// The measurements of one operation.
+struct BenchResult {
+    string operation;
+    long long ops = 0;
+    double seconds = 0;
+    vector<double> latencies;
+    long long bytesRead = 0, bytesWritten = 0;
+};
+
+using Clock = chrono::steady_clock;
+
+// Times every call of the given operation, and the bytes it moves to and from the file.
+template <class Operation>
+BenchResult measure(const string& name, BTree& tree, long long ops, Operation operation)
+{
+    BenchResult result;
+    result.operation = name;
+    result.ops = ops;
+    result.latencies.reserve(ops);
+
+    long long read = tree.storage().bytesRead(), written = tree.storage().bytesWritten();
+    Clock::time_point start = Clock::now();
+    for (long long i = 0; i < ops; ++i)
+    {
+        Clock::time_point before = Clock::now();
+        operation(i);
+        result.latencies.push_back(chrono::duration<double, nano>(Clock::now() - before).count());
+    }
+    tree.flush();
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+    result.bytesRead = tree.storage().bytesRead() - read;
+    result.bytesWritten = tree.storage().bytesWritten() - written;
+    return result;
+}
+
+// Returns the latency at the given fraction of the sorted latencies.
+double percentile(vector<double>& latencies, double fraction)
+{
+    if (latencies.empty()) return 0;
+    size_t index = min(latencies.size() - 1, (size_t) (fraction * latencies.size()));
+    nth_element(latencies.begin(), latencies.begin() + index, latencies.end());
+    return latencies[index];
+}
+
+void printResult(ostream& out, BenchResult& result)
+{
+    double p50 = percentile(result.latencies, 0.50), p99 = percentile(result.latencies, 0.99);
+    out << "{\"operation\": \"" << result.operation << "\""
+        << ", \"ops\": " << result.ops
+        << ", \"seconds\": " << result.seconds
+        << ", \"opsPerSecond\": " << (result.seconds > 0 ? result.ops / result.seconds : 0)
+        << ", \"p50Nanos\": " << p50
+        << ", \"p99Nanos\": " << p99
+        << ", \"bytesRead\": " << result.bytesRead
+        << ", \"bytesWritten\": " << result.bytesWritten << "}";
+}
+
+// Runs every operation on one configuration and returns the results.
+vector<BenchResult> runConfig(const BenchConfig& config, int ops, BTreeOptions options, const string& path)
+{
+    options.format = config.format;
+    mt19937 engine(42);
+
+    // The keys are 0..ops-1; the non-sequential distributions insert them shuffled
+    vector<int> keys(ops);
+    for (int i = 0; i < ops; ++i) keys[i] = i;
+    vector<int> insertOrder = keys;
+    if (config.distribution != Distribution::Sequential) shuffle(insertOrder.begin(), insertOrder.end(), engine);
+
+    // The keys probed by search, scan and remove
+    vector<int> probes(ops);
+    ZipfianGenerator zipfian(ops, 0.99);
+    vector<int> hot = insertOrder;
+    for (int i = 0; i < ops; ++i)
+    {
+        if (config.distribution == Distribution::Sequential) probes[i] = keys[i];
+        else if (config.distribution == Distribution::Random) probes[i] = (int) (engine() % ops);
+        else probes[i] = hot[zipfian(engine)];
+    }
+
+    // A node split by insert() keeps at least half of its pairs
+    int perNode = max(config.m / 2, 1);
+    int numberOfRecords = config.capacityFactor * (2 * ops / perNode + 16);
+
+    vector<BenchResult> results;
+    {
+        BTree tree(path, numberOfRecords, config.m, config.cellSize, options);
+        results.push_back(measure("insert", tree, ops, [&](long long i) {
+            tree.insert(insertOrder[i], insertOrder[i] + 1);
+        }));
+        results.push_back(measure("search", tree, ops, [&](long long i) {
+            tree.search(probes[i]);
+        }));
+        BTree::Frozen frozen = tree.freeze();
+        volatile int found = 0;
+        results.push_back(measure("frozenSearch", tree, ops, [&](long long i) {
+            found = frozen.search(probes[i]);
+        }));
+        results.push_back(measure("scan100", tree, max(ops / 100, 1), [&](long long i) {
+            int lo = probes[i];
+            for (const auto& p: tree.scan(lo, lo + 99)) (void) p;
+        }));
+        results.push_back(measure("remove", tree, ops / 2, [&](long long i) {
+            tree.remove(probes[i]);
+        }));
+    }
+    {
+        BTree tree(path, numberOfRecords, config.m, config.cellSize, options);
+        vector<pair<int, int>> pairs;
+        for (int key: insertOrder) pairs.emplace_back(key, key + 1);
+        BenchResult result = measure("bulkLoad", tree, 1, [&](long long) {
+            tree.bulkLoad(pairs.begin(), pairs.end());
+        });
+
+        // Report the throughput in pairs
+        result.ops = ops;
+        results.push_back(move(result));
+    }
+    {
+        BTree tree(path, numberOfRecords, config.m, config.cellSize, options);
+        const int batchSize = 1000;
+        vector<pair<int, int>> pairs;
+        for (int key: insertOrder) pairs.emplace_back(key, key + 1);
+        results.push_back(measure("insertBatch1000", tree, (ops + batchSize - 1) / batchSize, [&](long long i) {
+            auto first = pairs.begin() + i * batchSize;
+            tree.insertBatch(first, first + min((long long) batchSize, (long long) pairs.size() - i * batchSize));
+        }));
+    }
+    std::remove(path.c_str());
+    return results;
+}
+
+int main(int argc, char* argv[])
+{
+    int ops = 10000;
+    BTreeOptions options;
+    string path = "bench.btree";
+    for (int i = 1; i < argc; ++i)
+    {
+        string argument = argv[i];
+        if (argument == "--ops" && i + 1 < argc) ops = max(atoi(argv[++i]), 2);
+        else if (argument == "--pool" && i + 1 < argc) options.bufferPoolRecords = atoi(argv[++i]);
+        else if (argument == "--mapped") options.storage = StorageBackend::Mapped;
+        else if (argument == "--async") options.asyncIO = AsyncBackend::Uring;
+        else if (argument == "--path" && i + 1 < argc) path = argv[++i];
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--ops N] [--pool RECORDS] [--mapped] [--async] [--path FILE]\n";
+            return 1;
+        }
+    }
+
+    // Text cells must be wide enough for the largest key
+    int textCellSize = (int) to_string(ops).size() + 1;
+
+    vector<BenchConfig> configs;
+    for (int m: {5, 16, 64})
+        for (auto format: {make_pair(CellFormat::Text, textCellSize),
+                           make_pair(CellFormat::Binary, 4), make_pair(CellFormat::Binary, 8)})
+            for (int capacityFactor: {1, 8})
+                for (Distribution distribution: {Distribution::Sequential, Distribution::Random, Distribution::Zipfian})
+                    configs.push_back({format.first, m, format.second, capacityFactor, distribution});
+
+    cout << "{\"ops\": " << ops
+         << ", \"bufferPoolRecords\": " << options.bufferPoolRecords
+         << ", \"storage\": \"" << (options.storage == StorageBackend::Mapped ? "mapped" : "stream") << "\""
+         << ", \"async\": " << (options.asyncIO != AsyncBackend::None ? "true" : "false")
+         << ", \"runs\": [\n";
+    for (size_t c = 0; c < configs.size(); ++c)
+    {
+        const BenchConfig& config = configs[c];
+        vector<BenchResult> results = runConfig(config, ops, options, path);
+
+        cout << "  {\"format\": \"" << (config.format == CellFormat::Text ? "text" : "binary") << "\""
+             << ", \"m\": " << config.m
+             << ", \"cellSize\": " << config.cellSize
+             << ", \"capacityFactor\": " << config.capacityFactor
+             << ", \"distribution\": \"" << distributionName(config.distribution) << "\""
+             << ", \"results\": [\n";
+        for (size_t r = 0; r < results.size(); ++r)
+        {
+            cout << "    ";
+            printResult(cout, results[r]);
+            cout << (r + 1 < results.size() ? ",\n" : "\n");
+        }
+        cout << "  ]}" << (c + 1 < configs.size() ? ",\n" : "\n");
+    }
+    cout << "]}\n";
+    return 0;
+}
@@ -0,0 +1,6327 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <exception>
+#include <sstream>
+#include <utility>
+#include <algorithm>
+#include <stack>
+#include <queue>
+#include <memory>
+#include <cstdint>
+#include <climits>
+#include <limits>
+#include <type_traits>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <functional>
+#include <chrono>
+#include <charconv>
+#include <initializer_list>
+#include <filesystem>
+#include <unordered_map>
+#include <set>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define BTREE_IO_URING
+#endif
+#endif
+using namespace std;
+
+// Parses the integer held in a padded text cell of the given size.
+inline long long ctoi(const char c[], int size) {
+    int i = 0;
+    long long value = 0;
+    bool negative = false;
+    while (i < size && c[i] == ' ') ++i;
+    if (i < size && c[i] == '-') {
+        negative = true;
+        ++i;
+    }
+    while (i < size && c[i] >= '0' && c[i] <= '9') value = value * 10 + (c[i++] - '0');
+    return negative ? -value : value;
+}
+
+// Returns the index of the first key not less than key in a sorted array of keys.
+// A branchless binary search, so the compiler emits conditional moves.
+template <class Key>
+inline int lowerBoundScalar(const Key* keys, int count, Key key) {
+    if (count == 0) return 0;
+    const Key* base = keys;
+    int n = count;
+    while (n > 1) {
+        int half = n / 2;
+        base = base[half] < key ? base + half : base;
+        n -= half;
+    }
+    return (int) (base - keys) + (*base < key);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BTREE_X86_KERNELS
+
+// Returns the index of the first key not less than key in a sorted array of keys
+// by counting the keys less than key, 8 at a time with AVX2.
+__attribute__((target("avx2")))
+inline int lowerBoundAvx2(const int* keys, int count, int key) {
+    __m256i needle = _mm256_set1_epi32(key);
+    int less = 0, i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) (keys + i));
+        __m256i mask = _mm256_cmpgt_epi32(needle, block);
+        less += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(mask)));
+    }
+    for (; i < count; ++i) less += keys[i] < key;
+    return less;
+}
+
+// The same count for 64-bit keys, 4 at a time with AVX2.
+__attribute__((target("avx2")))
+inline int lowerBoundAvx2(const int64_t* keys, int count, int64_t key) {
+    __m256i needle = _mm256_set1_epi64x(key);
+    int less = 0, i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) (keys + i));
+        __m256i mask = _mm256_cmpgt_epi64(needle, block);
+        less += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(mask)));
+    }
+    for (; i < count; ++i) less += keys[i] < key;
+    return less;
+}
+
+// The same count of the keys less than key, 4 at a time with SSE2.
+inline int lowerBoundSse2(const int* keys, int count, int key) {
+    __m128i needle = _mm_set1_epi32(key);
+    int less = 0, i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (keys + i));
+        __m128i mask = _mm_cmpgt_epi32(needle, block);
+        less += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(mask)));
+    }
+    for (; i < count; ++i) less += keys[i] < key;
+    return less;
+}
+#endif
+
+// Returns the index of the first key not less than key in a sorted array of keys
+// with the widest SIMD kernel the processor supports, whatever the count.
+inline int simdLowerBound(const int* keys, int count, int key) {
+    using Kernel = int (*)(const int*, int, int);
+    static const Kernel simd = []() -> Kernel {
+#ifdef BTREE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return lowerBoundAvx2;
+        if (__builtin_cpu_supports("sse2")) return lowerBoundSse2;
+#endif
+        return lowerBoundScalar<int>;
+    }();
+    return simd(keys, count, key);
+}
+
+// The same search in a sorted array of 64-bit keys, with AVX2 if the processor supports it.
+inline int simdLowerBound(const int64_t* keys, int count, int64_t key) {
+    using Kernel = int (*)(const int64_t*, int, int64_t);
+    static const Kernel simd = []() -> Kernel {
+#ifdef BTREE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return lowerBoundAvx2;
+#endif
+        return lowerBoundScalar<int64_t>;
+    }();
+    return simd(keys, count, key);
+}
+
+// Keys of other types have no SIMD kernel and use the branchless binary search.
+template <class Key>
+inline int simdLowerBound(const Key* keys, int count, Key key) {
+    return lowerBoundScalar(keys, count, key);
+}
+
+// Nodes with at least this many keys are searched with the SIMD kernel.
+const int simdSearchThreshold = 32;
+
+// Returns the index of the first key not less than key in a sorted array of keys.
+// Large nodes use the widest SIMD kernel the processor supports,
+// the rest use the branchless binary search.
+template <class Key>
+inline int keyLowerBound(const Key* keys, int count, Key key) {
+    return count >= simdSearchThreshold ? simdLowerBound(keys, count, key) : lowerBoundScalar(keys, count, key);
+}
+
+// Mixes the bits of a key into a well-spread 64-bit hash (splitmix64).
+inline uint64_t mixKey(uint64_t key) {
+    uint64_t h = key + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+class InvalidRecordNumber : public exception {
+private:
+    int recordNumber;
+
+public:
+    explicit InvalidRecordNumber(int _recordNumber) : recordNumber{_recordNumber} {}
+};
+
+
+class InvalidPairNumber : public exception {
+private:
+    int pairNumber;
+public:
+    explicit InvalidPairNumber(int _pairNumber) : pairNumber{_pairNumber} {}
+};
+
+class InvalidCellSize : public exception {
+private:
+    int cellSize;
+public:
+    explicit InvalidCellSize(int _cellSize) : cellSize{_cellSize} {}
+};
+
+class InvalidOrder : public exception {
+private:
+    int m;
+public:
+    explicit InvalidOrder(int _m) : m{_m} {}
+};
+
+class UnsupportedStorage : public exception {
+private:
+    string path;
+public:
+    explicit UnsupportedStorage(string _path) : path{move(_path)} {}
+};
+
+class InvalidHeader : public exception {
+private:
+    string path;
+public:
+    explicit InvalidHeader(string _path) : path{move(_path)} {}
+};
+
+class InvalidShards : public exception {
+private:
+    int shards;
+public:
+    explicit InvalidShards(int _shards) : shards{_shards} {}
+};
+
+class InvalidOffset : public exception {
+private:
+    long long offset;
+public:
+    explicit InvalidOffset(long long _offset) : offset{_offset} {}
+};
+
+// Blocks until the written bytes of the file at the given path reach the disk.
+inline void syncPath(const string& path)
+{
+#ifndef _WIN32
+    // An fstream does not expose its descriptor,
+    // but syncing any descriptor of the file flushes its pages
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd != -1)
+    {
+        fsync(fd);
+        ::close(fd);
+    }
+#endif
+}
+
+// The bytes of the b-tree file.
+class Storage {
+public:
+    virtual ~Storage() = default;
+
+    // Reads size bytes at the given offset of the file.
+    virtual void read(long long offset, char* bytes, int size) = 0;
+
+    // Writes size bytes at the given offset of the file,
+    // growing the file if needed.
+    virtual void write(long long offset, const char* bytes, int size) = 0;
+
+    // Makes sure the file holds at least the given number of bytes.
+    virtual void reserve(long long size) = 0;
+
+    // Returns the number of bytes written to the file so far.
+    virtual long long size() = 0;
+
+    // Cuts or extends the file to the given number of bytes.
+    virtual void resize(long long size) = 0;
+
+    // Hands the written bytes over to the operating system.
+    virtual void flush() = 0;
+
+    // Blocks until the written bytes reach the disk.
+    virtual void sync() = 0;
+
+    // Returns the number of bytes read from the file.
+    long long bytesRead() const { return readCount.load(memory_order_relaxed); }
+
+    // Returns the number of bytes written to the file.
+    long long bytesWritten() const { return writeCount.load(memory_order_relaxed); }
+
+    // Returns the number of reads and writes, each of which starts at its own position.
+    long long seeks() const { return seekCount.load(memory_order_relaxed); }
+
+    // Counts a read or write of the file made around the storage, in the background.
+    void countBackground(bool write, int size)
+    {
+        if (write) countWrite(size);
+        else countRead(size);
+    }
+
+protected:
+    atomic<long long> readCount{0}, writeCount{0}, seekCount{0};
+
+    void countRead(int size)
+    {
+        readCount.fetch_add(size, memory_order_relaxed);
+        seekCount.fetch_add(1, memory_order_relaxed);
+    }
+
+    void countWrite(int size)
+    {
+        writeCount.fetch_add(size, memory_order_relaxed);
+        seekCount.fetch_add(1, memory_order_relaxed);
+    }
+};
+
+// Accesses the b-tree file through an fstream.
+class StreamStorage : public Storage {
+private:
+    string path;
+    fstream file;
+
+public:
+    // Opens the file at the given path, truncating it unless told otherwise.
+    explicit StreamStorage(string _path, bool truncate = true) : path{move(_path)}
+    {
+        if (!truncate) file.open(path, ios::in | ios::out | ios::binary);
+        if (!file.is_open()) file.open(path, ios::trunc | ios::in | ios::out | ios::binary);
+        if (!file.is_open()) throw UnsupportedStorage(path);
+    }
+
+    void read(long long offset, char* bytes, int size) override
+    {
+        countRead(size);
+        file.seekg(offset, ios::beg);
+        file.read(bytes, size);
+
+        // Bytes past the end of the file read as zeros,
+        // and the stream stays usable for the writes that append them
+        if (file.gcount() < size)
+        {
+            memset(bytes + file.gcount(), 0, size - file.gcount());
+            file.clear();
+        }
+    }
+
+    void write(long long offset, const char* bytes, int size) override
+    {
+        countWrite(size);
+        file.seekp(offset, ios::beg);
+        file.write(bytes, size);
+    }
+
+    void reserve(long long size) override {}
+
+    long long size() override
+    {
+        file.seekg(0, ios::end);
+        return (long long) file.tellg();
+    }
+
+    void resize(long long size) override
+    {
+        file.flush();
+        filesystem::resize_file(path, size);
+    }
+
+    void flush() override
+    {
+        file.flush();
+    }
+
+    void sync() override
+    {
+        file.flush();
+        syncPath(path);
+    }
+};
+
+#ifndef _WIN32
+// Accesses the b-tree file with pread() and pwrite(),
+// so threads do not share a file position.
+class PositionalStorage : public Storage {
+private:
+    int fd = -1;
+
+public:
+    // Opens the file at the given path, truncating it unless told otherwise.
+    explicit PositionalStorage(const string& path, bool truncate = true)
+    {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+        if (fd == -1) throw UnsupportedStorage(path);
+    }
+
+    ~PositionalStorage() override
+    {
+        ::close(fd);
+    }
+
+    void read(long long offset, char* bytes, int size) override
+    {
+        countRead(size);
+        while (size > 0)
+        {
+            ssize_t done = pread(fd, bytes, size, offset);
+            if (done == -1 && errno == EINTR) continue;
+            if (done < 0) throw UnsupportedStorage("pread");
+
+            // Bytes past the end of the file read as zeros
+            if (done == 0)
+            {
+                memset(bytes, 0, size);
+                return;
+            }
+            bytes += done;
+            offset += done;
+            size -= (int) done;
+        }
+    }
+
+    void write(long long offset, const char* bytes, int size) override
+    {
+        countWrite(size);
+        while (size > 0)
+        {
+            ssize_t done = pwrite(fd, bytes, size, offset);
+            if (done == -1 && errno == EINTR) continue;
+            if (done <= 0) throw UnsupportedStorage("pwrite");
+            bytes += done;
+            offset += done;
+            size -= (int) done;
+        }
+    }
+
+    void reserve(long long size) override {}
+
+    long long size() override
+    {
+        struct stat status;
+        return fstat(fd, &status) == 0 ? (long long) status.st_size : 0;
+    }
+
+    void resize(long long size) override
+    {
+        if (ftruncate(fd, size) != 0) throw UnsupportedStorage("ftruncate");
+    }
+
+    void flush() override {}
+
+    void sync() override
+    {
+        fsync(fd);
+    }
+};
+
+// Accesses the b-tree file through a shared memory mapping,
+// so reads and writes are plain loads and stores.
+class MappedStorage : public Storage {
+private:
+    int fd = -1;
+
+    // The address and size of the mapping.
+    char* mapping = nullptr;
+    long long mappedSize = 0;
+
+    // The end of the written bytes. The mapping grows past it,
+    // and the file is cut back to it when it is closed.
+    atomic<long long> end{0};
+
+    // Resizes the file and maps the new size.
+    void remap(long long size)
+    {
+        if (mapping) munmap(mapping, mappedSize);
+        mapping = nullptr;
+
+        if (ftruncate(fd, size) != 0) throw UnsupportedStorage("ftruncate");
+        void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED) throw UnsupportedStorage("mmap");
+
+        mapping = (char*) address;
+        mappedSize = size;
+    }
+
+public:
+    // Opens the file at the given path, truncating it unless told otherwise.
+    explicit MappedStorage(const string& path, bool truncate = true)
+    {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+        if (fd == -1) throw UnsupportedStorage(path);
+
+        struct stat status;
+        if (fstat(fd, &status) == 0 && status.st_size > 0) remap(end = status.st_size);
+    }
+
+    ~MappedStorage() override
+    {
+        if (mapping)
+        {
+            msync(mapping, mappedSize, MS_ASYNC);
+            munmap(mapping, mappedSize);
+        }
+
+        // Cut off the part of the file mapped ahead of the writes;
+        // a failure only leaves zeros after the written bytes
+        if (mappedSize > end && ftruncate(fd, end) != 0) end = mappedSize;
+        ::close(fd);
+    }
+
+    void read(long long offset, char* bytes, int size) override
+    {
+        countRead(size);
+        if (offset + size > mappedSize)
+        {
+            memset(bytes, 0, size);
+            if (offset >= mappedSize) return;
+            size = (int) (mappedSize - offset);
+        }
+        memcpy(bytes, mapping + offset, size);
+    }
+
+    void write(long long offset, const char* bytes, int size) override
+    {
+        countWrite(size);
+        if (offset + size > mappedSize) reserve(offset + size);
+        memcpy(mapping + offset, bytes, size);
+        if (offset + size > end) end = offset + size;
+    }
+
+    void reserve(long long size) override
+    {
+        // Grow geometrically so appending records remaps rarely
+        if (size > mappedSize) remap(max(size, 2 * mappedSize));
+    }
+
+    long long size() override { return end; }
+
+    void resize(long long size) override
+    {
+        if (size > 0) remap(size);
+        else
+        {
+            if (mapping) munmap(mapping, mappedSize);
+            mapping = nullptr;
+            mappedSize = 0;
+            if (ftruncate(fd, 0) != 0) throw UnsupportedStorage("ftruncate");
+        }
+        end = size;
+    }
+
+    void flush() override {}
+
+    void sync() override
+    {
+        if (mapping) msync(mapping, mappedSize, MS_SYNC);
+    }
+};
+#endif
+
+// Reads and writes the b-tree file in the background.
+// Every request returns a ticket, and its buffer must stay untouched until the ticket is waited for.
+// Not thread-safe; the buffer pool calls it under its latch.
+class AsyncIO {
+public:
+    virtual ~AsyncIO() = default;
+
+    // Starts reading size bytes at the given offset of the file into bytes.
+    // Bytes past the end of the file read as zeros.
+    virtual long long read(long long offset, char* bytes, int size) = 0;
+
+    // Starts writing size bytes at the given offset of the file.
+    virtual long long write(long long offset, const char* bytes, int size) = 0;
+
+    // Hands the requests started so far over to the operating system at once.
+    virtual void submit() = 0;
+
+    // Blocks until the request with the given ticket is done.
+    virtual void wait(long long ticket) = 0;
+
+    // Blocks until every request is done.
+    virtual void drain() = 0;
+};
+
+#ifndef _WIN32
+// Queues the requests of an AsyncIO on its own descriptor of the file,
+// at most depth of them at once. A request that fails or comes back short
+// is finished synchronously, which throws if the file cannot be accessed.
+class QueuedIO : public AsyncIO {
+protected:
+    struct Request {
+        long long ticket = -1;
+        bool write = false;
+        long long offset = 0;
+        char* bytes = nullptr;
+        int size = 0;
+
+        // Set when the request is done, with the bytes transferred or a negative errno.
+        bool done = true;
+        long long result = 0;
+    };
+
+    int fd = -1;
+
+    // Counts the bytes read and written.
+    Storage& storage;
+
+    // The request with ticket t is in slot t % depth,
+    // so starting a request waits for the one depth tickets before it.
+    vector<Request> requests;
+    long long nextTicket = 0;
+
+    Request& slot(long long ticket) { return requests[ticket % (long long) requests.size()]; }
+
+    // Queues the given request.
+    virtual void enqueue(Request& request) = 0;
+
+    // Blocks until the given request is done.
+    virtual void complete(Request& request) = 0;
+
+    long long start(bool write, long long offset, char* bytes, int size)
+    {
+        long long ticket = nextTicket++;
+        if (ticket >= (long long) requests.size()) wait(ticket - (long long) requests.size());
+
+        storage.countBackground(write, size);
+        Request& request = slot(ticket);
+        request = Request{ticket, write, offset, bytes, size, false, 0};
+        enqueue(request);
+        return ticket;
+    }
+
+public:
+    QueuedIO(const string& path, int depth, Storage& _storage) : storage{_storage}, requests(max(depth, 1))
+    {
+        fd = ::open(path.c_str(), O_RDWR);
+        if (fd == -1) throw UnsupportedStorage(path);
+    }
+
+    ~QueuedIO() override
+    {
+        ::close(fd);
+    }
+
+    long long read(long long offset, char* bytes, int size) override
+    {
+        return start(false, offset, bytes, size);
+    }
+
+    long long write(long long offset, const char* bytes, int size) override
+    {
+        return start(true, offset, const_cast<char*>(bytes), size);
+    }
+
+    void wait(long long ticket) override
+    {
+        Request& request = slot(ticket);
+        if (request.ticket != ticket) return;
+        complete(request);
+        request.ticket = -1;
+
+        // Finish the rest of a short or failed request with plain pread() and pwrite()
+        long long done = max(request.result, 0LL);
+        while (done < request.size)
+        {
+            ssize_t moved = request.write
+                ? pwrite(fd, request.bytes + done, request.size - done, request.offset + done)
+                : pread(fd, request.bytes + done, request.size - done, request.offset + done);
+            if (moved == -1 && errno == EINTR) continue;
+            if (moved == 0 && !request.write)
+            {
+                memset(request.bytes + done, 0, request.size - done);
+                return;
+            }
+            if (moved <= 0) throw UnsupportedStorage(request.write ? "pwrite" : "pread");
+            done += moved;
+        }
+    }
+
+    void drain() override
+    {
+        submit();
+        for (long long ticket = max(nextTicket - (long long) requests.size(), 0LL); ticket < nextTicket; ++ticket)
+            wait(ticket);
+    }
+};
+
+#ifdef BTREE_IO_URING
+// Queues the requests in an io_uring, so that a whole batch costs one system call.
+// It is set up with raw system calls, so the b-tree needs no liburing.
+class UringIO : public QueuedIO {
+private:
+    int ring = -1;
+
+    // The shared rings and the submission entries.
+    char* submissionRing = nullptr;
+    char* completionRing = nullptr;
+    size_t submissionRingSize = 0, completionRingSize = 0;
+    io_uring_sqe* entries = nullptr;
+    size_t entriesSize = 0;
+
+    unsigned *submissionTail, *submissionMask, *submissionArray;
+    unsigned *completionHead, *completionTail, *completionMask;
+    io_uring_cqe* completions;
+
+    // The requests queued but not yet handed to the kernel.
+    unsigned unsubmitted = 0;
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+    {
+        return (int) syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags, nullptr, 0);
+    }
+
+    // Marks the requests the kernel has completed as done.
+    void reap()
+    {
+        unsigned head = *completionHead;
+        unsigned tail = __atomic_load_n(completionTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe& completion = completions[head & *completionMask];
+            Request& request = slot((long long) completion.user_data);
+            request.result = completion.res;
+            request.done = true;
+        }
+        __atomic_store_n(completionHead, head, __ATOMIC_RELEASE);
+    }
+
+    void release()
+    {
+        if (entries) munmap(entries, entriesSize);
+        if (completionRing && completionRing != submissionRing) munmap(completionRing, completionRingSize);
+        if (submissionRing) munmap(submissionRing, submissionRingSize);
+        if (ring != -1) ::close(ring);
+    }
+
+protected:
+    void enqueue(Request& request) override
+    {
+        unsigned tail = *submissionTail;
+        unsigned index = tail & *submissionMask;
+        io_uring_sqe& entry = entries[index];
+        memset(&entry, 0, sizeof entry);
+        entry.opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+        entry.fd = fd;
+        entry.off = (uint64_t) request.offset;
+        entry.addr = (uint64_t) (uintptr_t) request.bytes;
+        entry.len = (unsigned) request.size;
+        entry.user_data = (uint64_t) request.ticket;
+        submissionArray[index] = index;
+        __atomic_store_n(submissionTail, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted;
+    }
+
+    void complete(Request& request) override
+    {
+        submit();
+        reap();
+        while (!request.done)
+        {
+            if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) throw UnsupportedStorage("io_uring_enter");
+            reap();
+        }
+    }
+
+public:
+    // Sets up a ring of depth entries on the file at the given path.
+    // Throws UnsupportedStorage if the kernel does not allow io_uring.
+    UringIO(const string& path, int depth, Storage& storage) : QueuedIO(path, depth, storage)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof params);
+        ring = (int) syscall(__NR_io_uring_setup, (unsigned) requests.size(), &params);
+        if (ring < 0)
+        {
+            ring = -1;
+            throw UnsupportedStorage("io_uring_setup");
+        }
+
+        submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMapping = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMapping) submissionRingSize = completionRingSize = max(submissionRingSize, completionRingSize);
+
+        auto map = [&](size_t size, off_t offset) {
+            void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, offset);
+            if (address == MAP_FAILED)
+            {
+                release();
+                throw UnsupportedStorage("mmap");
+            }
+            return (char*) address;
+        };
+        submissionRing = map(submissionRingSize, IORING_OFF_SQ_RING);
+        completionRing = singleMapping ? submissionRing : map(completionRingSize, IORING_OFF_CQ_RING);
+        entriesSize = params.sq_entries * sizeof(io_uring_sqe);
+        entries = (io_uring_sqe*) map(entriesSize, IORING_OFF_SQES);
+
+        submissionTail = (unsigned*) (submissionRing + params.sq_off.tail);
+        submissionMask = (unsigned*) (submissionRing + params.sq_off.ring_mask);
+        submissionArray = (unsigned*) (submissionRing + params.sq_off.array);
+        completionHead = (unsigned*) (completionRing + params.cq_off.head);
+        completionTail = (unsigned*) (completionRing + params.cq_off.tail);
+        completionMask = (unsigned*) (completionRing + params.cq_off.ring_mask);
+        completions = (io_uring_cqe*) (completionRing + params.cq_off.cqes);
+    }
+
+    ~UringIO() override
+    {
+        try { drain(); } catch (const UnsupportedStorage&) {}
+        release();
+    }
+
+    void submit() override
+    {
+        while (unsubmitted > 0)
+        {
+            int submitted = enter(unsubmitted, 0, 0);
+            if (submitted < 0 && errno == EINTR) continue;
+            if (submitted <= 0) throw UnsupportedStorage("io_uring_enter");
+            unsubmitted -= submitted;
+        }
+    }
+};
+#endif
+
+// Hands the requests to a pool of threads that block in pread() and pwrite(),
+// where io_uring is not available.
+class ThreadPoolIO : public QueuedIO {
+private:
+    vector<thread> workers;
+    queue<Request*> pending;
+    bool stopping = false;
+
+    // Guards pending, stopping and the results of the requests.
+    mutex latch;
+    condition_variable queued, finished;
+
+    void work()
+    {
+        unique_lock<mutex> lock(latch);
+        while (true)
+        {
+            queued.wait(lock, [&] { return stopping || !pending.empty(); });
+            if (pending.empty()) return;
+            Request& request = *pending.front();
+            pending.pop();
+            lock.unlock();
+
+            ssize_t moved = request.write
+                ? pwrite(fd, request.bytes, request.size, request.offset)
+                : pread(fd, request.bytes, request.size, request.offset);
+            long long result = moved < 0 ? -errno : moved;
+
+            lock.lock();
+            request.result = result;
+            request.done = true;
+            finished.notify_all();
+        }
+    }
+
+protected:
+    void enqueue(Request& request) override
+    {
+        {
+            lock_guard<mutex> lock(latch);
+            pending.push(&request);
+        }
+        queued.notify_one();
+    }
+
+    void complete(Request& request) override
+    {
+        unique_lock<mutex> lock(latch);
+        finished.wait(lock, [&] { return request.done; });
+    }
+
+public:
+    ThreadPoolIO(const string& path, int depth, int threads, Storage& storage) : QueuedIO(path, depth, storage)
+    {
+        for (int i = 0; i < max(threads, 1); ++i) workers.emplace_back([this] { work(); });
+    }
+
+    ~ThreadPoolIO() override
+    {
+        try { drain(); } catch (const UnsupportedStorage&) {}
+        {
+            lock_guard<mutex> lock(latch);
+            stopping = true;
+        }
+        queued.notify_all();
+        for (thread& worker: workers) worker.join();
+    }
+
+    void submit() override {}
+};
+#endif
+
+// Caches whole records of the b-tree file in memory.
+// Records are evicted with the CLOCK algorithm,
+// and dirty records are written back when they are evicted or flushed.
+// With background I/O, records can be read ahead of their fetch,
+// and a flush writes the dirty records back all at once.
+class BufferPool {
+public:
+    // Reads the record with the given number into the given buffer.
+    using Loader = function<void(int recordNumber, char* record)>;
+
+    // Writes the given buffer into the record with the given number.
+    using Storer = function<void(int recordNumber, const char* record)>;
+
+private:
+    struct Frame {
+        // The number of the cached record, or -1 if the frame is free.
+        int recordNumber = -1;
+
+        // True if the cached record differs from the file.
+        bool dirty = false;
+
+        // The CLOCK reference bit.
+        bool referenced = false;
+
+        // The ticket of the background read filling the frame, or -1.
+        long long loading = -1;
+    };
+
+    // The number of bytes in one record.
+    int recordSize;
+
+    // The contents of the frames, one record after another.
+    vector<char> data;
+
+    vector<Frame> frames;
+
+    // Maps a record number to the frame caching it.
+    unordered_map<int, int> table;
+
+    // The entry of the last evicted record, reused for the next record cached
+    // so that a full pool caches records without allocating.
+    unordered_map<int, int>::node_type spare;
+
+    // The frame the CLOCK hand points at.
+    int hand = 0;
+
+    Loader load;
+    Storer store;
+
+    // Reads and writes records in the background, or null.
+    // Destroyed before the frames its requests fill.
+    unique_ptr<AsyncIO> io;
+
+    // Read without the latch by statistics, so they are relaxed atomics.
+    atomic<long long> hitCount{0}, missCount{0}, prefetchCount{0};
+
+    // Serializes read(), write(), flush() and discard() across threads.
+    mutex latch;
+
+    // Returns a frame to hold a new record, evicting a cached record if needed.
+    int victim()
+    {
+        while (true)
+        {
+            Frame& frame = frames[hand];
+            int current = hand;
+            hand = (hand + 1) % (int) frames.size();
+
+            if (frame.recordNumber == -1) return current;
+
+            // Give referenced records a second chance
+            if (frame.referenced)
+            {
+                frame.referenced = false;
+                continue;
+            }
+
+            finishLoading(current);
+            if (frame.dirty) store(frame.recordNumber, &data[(size_t) current * recordSize]);
+            spare = table.extract(frame.recordNumber);
+            frame = Frame{};
+            return current;
+        }
+    }
+
+    // Blocks until the background read into the given frame, if any, is done.
+    void finishLoading(int index)
+    {
+        if (frames[index].loading == -1) return;
+        io->wait(frames[index].loading);
+        frames[index].loading = -1;
+    }
+
+    // Caches the given record in the given frame.
+    void assign(int index, int recordNumber)
+    {
+        frames[index].recordNumber = recordNumber;
+        if (spare)
+        {
+            spare.key() = recordNumber;
+            spare.mapped() = index;
+            table.insert(move(spare));
+        }
+        else table[recordNumber] = index;
+    }
+
+public:
+    // Creates a pool of the given number of frames of recordSize bytes each,
+    // reading ahead and writing back through the given background I/O if it is not null.
+    BufferPool(int capacity, int _recordSize, Loader _load, Storer _store, unique_ptr<AsyncIO> _io = nullptr) :
+        recordSize{_recordSize},
+        data((size_t) capacity * _recordSize),
+        frames(capacity),
+        load{move(_load)},
+        store{move(_store)},
+        io{move(_io)}
+    {
+        table.reserve(capacity);
+    }
+
+    // Returns the cached contents of the given record, reading it on a miss.
+    // Marks the record dirty if it is about to be modified.
+    // The returned pointer is valid until the next call to fetch().
+    // Not latched; concurrent callers go through read() and write().
+    char* fetch(int recordNumber, bool forWrite)
+    {
+        int index;
+        auto it = table.find(recordNumber);
+        if (it != table.end())
+        {
+            hitCount.fetch_add(1, memory_order_relaxed);
+            index = it->second;
+            finishLoading(index);
+        }
+        else
+        {
+            missCount.fetch_add(1, memory_order_relaxed);
+            index = victim();
+            load(recordNumber, &data[(size_t) index * recordSize]);
+            assign(index, recordNumber);
+        }
+
+        frames[index].referenced = true;
+        if (forWrite) frames[index].dirty = true;
+        return &data[(size_t) index * recordSize];
+    }
+
+    // Copies size bytes at the given offset of the given record into bytes.
+    void read(int recordNumber, int offset, char* bytes, int size)
+    {
+        lock_guard<mutex> lock(latch);
+        memcpy(bytes, fetch(recordNumber, false) + offset, size);
+    }
+
+    // Copies size bytes into the given offset of the given record.
+    void write(int recordNumber, int offset, const char* bytes, int size)
+    {
+        lock_guard<mutex> lock(latch);
+        memcpy(fetch(recordNumber, true) + offset, bytes, size);
+    }
+
+    // Returns true if the pool reads and writes in the background.
+    bool async() const { return io != nullptr; }
+
+    // Returns the number of frames.
+    int capacity() const { return (int) frames.size(); }
+
+    // Starts reading the given records into the pool in the background,
+    // so that fetching them later does not wait for the file.
+    // Cached records are skipped, and at most half of the frames are filled at once
+    // so that the records do not evict each other. Every record must be in the file.
+    void prefetch(const int* recordNumbers, int count)
+    {
+        if (!io) return;
+        lock_guard<mutex> lock(latch);
+        int started = 0;
+        for (int i = 0; i < count && started < capacity() / 2; ++i)
+        {
+            if (table.count(recordNumbers[i])) continue;
+            int index = victim();
+            assign(index, recordNumbers[i]);
+            frames[index].referenced = true;
+            frames[index].loading = io->read((long long) recordNumbers[i] * recordSize,
+                                             &data[(size_t) index * recordSize], recordSize);
+            ++started;
+        }
+        io->submit();
+        prefetchCount.fetch_add(started, memory_order_relaxed);
+    }
+
+    // Writes every dirty record back to the file.
+    void flush()
+    {
+        lock_guard<mutex> lock(latch);
+        if (!io)
+        {
+            for (int i = 0; i < (int) frames.size(); ++i)
+            {
+                if (!frames[i].dirty) continue;
+                store(frames[i].recordNumber, &data[(size_t) i * recordSize]);
+                frames[i].dirty = false;
+            }
+            return;
+        }
+
+        // Storing the highest dirty record also writes the records before it
+        // that the file does not hold yet, so the rest can be written in the background at once
+        int highest = -1;
+        for (int i = 0; i < (int) frames.size(); ++i)
+            if (frames[i].dirty && (highest == -1 || frames[i].recordNumber > frames[highest].recordNumber)) highest = i;
+        if (highest == -1) return;
+        store(frames[highest].recordNumber, &data[(size_t) highest * recordSize]);
+        frames[highest].dirty = false;
+
+        for (int i = 0; i < (int) frames.size(); ++i)
+        {
+            if (!frames[i].dirty) continue;
+            io->write((long long) frames[i].recordNumber * recordSize, &data[(size_t) i * recordSize], recordSize);
+            frames[i].dirty = false;
+        }
+        io->drain();
+    }
+
+    // Drops every cached record without writing it back.
+    void discard()
+    {
+        lock_guard<mutex> lock(latch);
+        if (io) io->drain();
+        for (Frame& frame: frames) frame = Frame{};
+        table.clear();
+        hand = 0;
+    }
+
+    // Returns the number of fetches served from memory.
+    long long hits() const { return hitCount.load(memory_order_relaxed); }
+
+    // Returns the number of fetches that had to read the file.
+    long long misses() const { return missCount.load(memory_order_relaxed); }
+
+    // Returns the number of records read ahead of their fetch.
+    long long prefetches() const { return prefetchCount.load(memory_order_relaxed); }
+};
+
+// An append-only redo log of the writes made to the records of a b-tree file.
+// The writes of each operation are followed by a commit entry,
+// and every entry carries a checksum so that a torn tail is ignored at recovery.
+class WriteAheadLog {
+public:
+    enum EntryType {
+        // Bytes written at an offset of a record.
+        WriteEntry = 1,
+
+        // The end of an operation; its writes are replayed.
+        CommitEntry,
+
+        // The file grew to the number of records held in recordNumber.
+        GrowEntry,
+
+        // A bulk load replaced the b-tree.
+        BulkLoadEntry
+    };
+
+    struct Entry {
+        int type;
+        long long operation;
+        int recordNumber;
+        int offset;
+        string bytes;
+    };
+
+private:
+    string path;
+    ofstream file;
+
+    // The entries appended since the last commit().
+    string tail;
+
+    // Identifies a log file ("BWAL").
+    static constexpr int32_t magic = 0x4c415742;
+
+    // Returns the FNV-1a hash of the given bytes.
+    static uint32_t checksum(const char* bytes, size_t size)
+    {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; ++i) hash = (hash ^ (unsigned char) bytes[i]) * 16777619u;
+        return hash;
+    }
+
+public:
+    explicit WriteAheadLog(string _path) : path{move(_path)} {}
+
+    // Reads the entries of the log file, stopping at the first torn or corrupt one.
+    // Returns false if there is no log file.
+    bool read(vector<Entry>& entries) const
+    {
+        ifstream in(path, ios::binary);
+        int32_t header;
+        if (!in.read((char*) &header, sizeof header) || header != magic) return false;
+        in.seekg(0, ios::end);
+        long long length = (long long) in.tellg();
+        in.seekg(sizeof header);
+
+        while (true)
+        {
+            char fields[24];
+            if (!in.read(fields, sizeof fields)) break;
+
+            Entry entry;
+            int32_t type, recordNumber, offset, size;
+            int64_t operation;
+            memcpy(&type, fields, 4);
+            memcpy(&operation, fields + 4, 8);
+            memcpy(&recordNumber, fields + 12, 4);
+            memcpy(&offset, fields + 16, 4);
+            memcpy(&size, fields + 20, 4);
+            // A torn length may be anything, so it must fit in the rest of the file
+            if (size < 0 || size > length - (long long) in.tellg() - (long long) sizeof(uint32_t)) break;
+
+            string body(fields, sizeof fields);
+            entry.bytes.resize(size);
+            uint32_t expected;
+            if (!in.read(&entry.bytes[0], size) || !in.read((char*) &expected, sizeof expected)) break;
+            body += entry.bytes;
+            if (checksum(body.data(), body.size()) != expected) break;
+
+            entry.type = type;
+            entry.operation = operation;
+            entry.recordNumber = recordNumber;
+            entry.offset = offset;
+            entries.push_back(move(entry));
+        }
+        return true;
+    }
+
+    // Replaces the log file with one holding only the entries appended since the last commit(),
+    // and blocks until it reaches the disk.
+    void reset()
+    {
+        // Swap the files in a single rename,
+        // so that a crash never leaves a b-tree file without its log
+        string nextPath = path + ".tmp";
+        {
+            ofstream next(nextPath, ios::binary | ios::trunc);
+            next.write((const char*) &magic, sizeof magic);
+            next.write(tail.data(), tail.size());
+            if (!next) throw UnsupportedStorage(nextPath);
+        }
+        syncPath(nextPath);
+        file.close();
+        if (rename(nextPath.c_str(), path.c_str()) != 0) throw UnsupportedStorage(path);
+        size_t slash = path.find_last_of('/');
+        syncPath(slash == string::npos ? "." : path.substr(0, slash + 1));
+
+        file.open(path, ios::binary | ios::app);
+        if (!file.is_open()) throw UnsupportedStorage(path);
+        tail.clear();
+    }
+
+    // Adds an entry to the end of the log, in memory until the next commit().
+    void append(int type, long long operation, int recordNumber, int offset, const char* bytes, int size)
+    {
+        size_t start = tail.size();
+        int32_t type32 = type, recordNumber32 = recordNumber, offset32 = offset, size32 = size;
+        int64_t operation64 = operation;
+        tail.append((const char*) &type32, 4);
+        tail.append((const char*) &operation64, 8);
+        tail.append((const char*) &recordNumber32, 4);
+        tail.append((const char*) &offset32, 4);
+        tail.append((const char*) &size32, 4);
+        tail.append(bytes, size);
+        uint32_t sum = checksum(tail.data() + start, tail.size() - start);
+        tail.append((const char*) &sum, sizeof sum);
+    }
+
+    // Returns true if entries were appended since the last commit().
+    bool pending() const { return !tail.empty(); }
+
+    // Writes the appended entries to the log file and blocks until they reach the disk.
+    void commit()
+    {
+        if (tail.empty()) return;
+        file.write(tail.data(), tail.size());
+        file.flush();
+        syncPath(path);
+        tail.clear();
+    }
+};
+
+// Counts the work of a b-tree. Every counter is a relaxed atomic,
+// which orders nothing, so the counters are cheap enough to stay enabled.
+class BTreeCounters {
+public:
+    // The operations whose work and latency are counted separately.
+    // The nodes read and written by the rest (scans, batches, bulk loads) count as Other.
+    enum Operation { InsertOperation, SearchOperation, RemoveOperation, OtherOperation, Operations };
+
+    // The number of latency buckets. Bucket i counts the latencies
+    // below bucketBound(i) nanoseconds, and the last one the rest.
+    static const int latencyBuckets = 32;
+
+    static long long bucketBound(int bucket) { return 128LL << bucket; }
+
+    struct OperationCounters {
+        atomic<long long> count{0}, nodeReads{0}, nodeWrites{0}, latencyNanos{0};
+        atomic<long long> latencies[latencyBuckets]{};
+    };
+
+    OperationCounters operations[Operations];
+
+    // Splits of a record other than the root, and of the root, which grow the b-tree.
+    atomic<long long> nodeSplits{0}, rootSplits{0};
+
+    atomic<long long> merges{0}, redistributions{0};
+
+    // Records taken from and returned to the available list.
+    atomic<long long> allocations{0}, frees{0};
+
+    // Searches answered by a Bloom filter without reading the leaf,
+    // and searches of absent keys whose filter let them through.
+    atomic<long long> bloomNegatives{0}, bloomFalsePositives{0};
+
+    static void add(atomic<long long>& counter, long long amount = 1)
+    {
+        counter.fetch_add(amount, memory_order_relaxed);
+    }
+
+    // Counts one operation that took the given number of nanoseconds.
+    void record(Operation operation, long long nanos)
+    {
+        int bucket = 0;
+        while (bucket < latencyBuckets - 1 && nanos >= bucketBound(bucket)) ++bucket;
+
+        OperationCounters& counters = operations[operation];
+        add(counters.count);
+        add(counters.latencyNanos, nanos);
+        add(counters.latencies[bucket]);
+    }
+};
+
+// The statistics of a b-tree at one moment, exported as JSON
+// or in the Prometheus text format.
+struct BTreeStatistics {
+    struct Operation {
+        string name;
+        long long count = 0, nodeReads = 0, nodeWrites = 0, latencyNanos = 0;
+
+        // The operations per latency bucket of BTreeCounters.
+        vector<long long> latencies;
+
+        // Returns the upper bound of the bucket that holds the given fraction
+        // of the latencies, or 0 if there are none.
+        long long percentileNanos(double fraction) const
+        {
+            long long seen = 0;
+            for (int bucket = 0; bucket < (int) latencies.size(); ++bucket)
+            {
+                seen += latencies[bucket];
+                if (count > 0 && seen >= fraction * count) return BTreeCounters::bucketBound(bucket);
+            }
+            return 0;
+        }
+    };
+
+    // Reads and writes at a position of the b-tree file, each of which seeks a stream.
+    long long seeks = 0;
+
+    long long bytesRead = 0, bytesWritten = 0;
+
+    // The records decoded and written as whole nodes by every operation.
+    long long nodeReads = 0, nodeWrites = 0;
+
+    long long nodeSplits = 0, rootSplits = 0, merges = 0, redistributions = 0;
+    long long allocations = 0, frees = 0;
+    long long poolHits = 0, poolMisses = 0, poolPrefetches = 0;
+    long long bloomNegatives = 0, bloomFalsePositives = 0;
+
+    // The record images kept in memory for live snapshots.
+    long long snapshotImages = 0;
+
+    // Returns the fraction of the searches of absent keys that the Bloom filters let through.
+    double bloomFalsePositiveRate() const
+    {
+        long long absent = bloomNegatives + bloomFalsePositives;
+        return absent > 0 ? (double) bloomFalsePositives / absent : 0;
+    }
+
+    // The number of levels of the b-tree, 0 if it is empty.
+    int height = 0;
+
+    // insert, search and remove.
+    vector<Operation> operations;
+
+    string toJson() const
+    {
+        ostringstream out;
+        out << "{\"seeks\": " << seeks
+            << ", \"bytesRead\": " << bytesRead
+            << ", \"bytesWritten\": " << bytesWritten
+            << ", \"nodeReads\": " << nodeReads
+            << ", \"nodeWrites\": " << nodeWrites
+            << ", \"nodeSplits\": " << nodeSplits
+            << ", \"rootSplits\": " << rootSplits
+            << ", \"merges\": " << merges
+            << ", \"redistributions\": " << redistributions
+            << ", \"allocations\": " << allocations
+            << ", \"frees\": " << frees
+            << ", \"poolHits\": " << poolHits
+            << ", \"poolMisses\": " << poolMisses
+            << ", \"poolPrefetches\": " << poolPrefetches
+            << ", \"bloomNegatives\": " << bloomNegatives
+            << ", \"bloomFalsePositives\": " << bloomFalsePositives
+            << ", \"bloomFalsePositiveRate\": " << bloomFalsePositiveRate()
+            << ", \"snapshotImages\": " << snapshotImages
+            << ", \"height\": " << height
+            << ", \"operations\": {";
+        for (size_t i = 0; i < operations.size(); ++i)
+        {
+            const Operation& operation = operations[i];
+            out << (i ? ", " : "") << "\"" << operation.name << "\": {\"count\": " << operation.count
+                << ", \"nodeReads\": " << operation.nodeReads
+                << ", \"nodeWrites\": " << operation.nodeWrites
+                << ", \"latencyNanos\": " << operation.latencyNanos
+                << ", \"p50Nanos\": " << operation.percentileNanos(0.50)
+                << ", \"p99Nanos\": " << operation.percentileNanos(0.99)
+                << ", \"latencies\": [";
+
+            // Only the buckets that hold latencies, by their upper bound (-1 for none)
+            bool first = true;
+            for (int bucket = 0; bucket < (int) operation.latencies.size(); ++bucket)
+            {
+                if (!operation.latencies[bucket]) continue;
+                long long bound = bucket + 1 < BTreeCounters::latencyBuckets ? BTreeCounters::bucketBound(bucket) : -1;
+                out << (first ? "" : ", ") << "{\"belowNanos\": " << bound << ", \"count\": " << operation.latencies[bucket] << "}";
+                first = false;
+            }
+            out << "]}";
+        }
+        out << "}}";
+        return out.str();
+    }
+
+    string toPrometheus() const
+    {
+        ostringstream out;
+        out.precision(9);
+        auto metric = [&](const char* name, const char* type, const char* help, long long value) {
+            out << "# HELP btree_" << name << ' ' << help << "\n# TYPE btree_" << name << ' ' << type << '\n'
+                << "btree_" << name << ' ' << value << '\n';
+        };
+        metric("seeks_total", "counter", "Reads and writes at a position of the b-tree file.", seeks);
+        metric("read_bytes_total", "counter", "Bytes read from the b-tree file.", bytesRead);
+        metric("written_bytes_total", "counter", "Bytes written to the b-tree file.", bytesWritten);
+        metric("node_splits_total", "counter", "Splits of records other than the root.", nodeSplits);
+        metric("root_splits_total", "counter", "Splits of the root.", rootSplits);
+        metric("merges_total", "counter", "Underflowed nodes merged into a sibling.", merges);
+        metric("redistributions_total", "counter", "Underflowed nodes that borrowed a pair from a sibling.", redistributions);
+        metric("allocations_total", "counter", "Records taken from the available list.", allocations);
+        metric("frees_total", "counter", "Records returned to the available list.", frees);
+        metric("pool_hits_total", "counter", "Buffer pool fetches served from memory.", poolHits);
+        metric("pool_misses_total", "counter", "Buffer pool fetches that read the file.", poolMisses);
+        metric("pool_prefetches_total", "counter", "Records read ahead into the buffer pool.", poolPrefetches);
+        metric("bloom_negatives_total", "counter", "Searches answered by a Bloom filter without reading the leaf.", bloomNegatives);
+        metric("bloom_false_positives_total", "counter", "Searches of absent keys that a Bloom filter let through.", bloomFalsePositives);
+        metric("snapshot_images", "gauge", "Record images kept in memory for live snapshots.", snapshotImages);
+        metric("height", "gauge", "Levels of the b-tree.", height);
+
+        auto perOperation = [&](const char* name, const char* help, long long Operation::*field) {
+            out << "# HELP btree_" << name << ' ' << help << "\n# TYPE btree_" << name << " counter\n";
+            for (const Operation& operation: operations)
+                out << "btree_" << name << "{operation=\"" << operation.name << "\"} " << operation.*field << '\n';
+        };
+        perOperation("operations_total", "Operations completed.", &Operation::count);
+        perOperation("node_reads_total", "Nodes read by the operations.", &Operation::nodeReads);
+        perOperation("node_writes_total", "Nodes written by the operations.", &Operation::nodeWrites);
+
+        out << "# HELP btree_operation_latency_seconds Latency of the operations.\n"
+            << "# TYPE btree_operation_latency_seconds histogram\n";
+        for (const Operation& operation: operations)
+        {
+            long long cumulative = 0;
+            for (int bucket = 0; bucket + 1 < (int) operation.latencies.size(); ++bucket)
+            {
+                cumulative += operation.latencies[bucket];
+                out << "btree_operation_latency_seconds_bucket{operation=\"" << operation.name
+                    << "\",le=\"" << BTreeCounters::bucketBound(bucket) / 1e9 << "\"} " << cumulative << '\n';
+            }
+            out << "btree_operation_latency_seconds_bucket{operation=\"" << operation.name << "\",le=\"+Inf\"} "
+                << operation.count << '\n'
+                << "btree_operation_latency_seconds_sum{operation=\"" << operation.name << "\"} "
+                << operation.latencyNanos / 1e9 << '\n'
+                << "btree_operation_latency_seconds_count{operation=\"" << operation.name << "\"} "
+                << operation.count << '\n';
+        }
+        return out.str();
+    }
+
+    // Replaces the file at the given path with toPrometheus(), for a textfile collector
+    // that must never see it half written.
+    void writePrometheus(const string& path) const
+    {
+        string nextPath = path + ".tmp";
+        {
+            ofstream next(nextPath, ios::trunc);
+            next << toPrometheus();
+            if (!next) throw UnsupportedStorage(nextPath);
+        }
+        if (rename(nextPath.c_str(), path.c_str()) != 0) throw UnsupportedStorage(path);
+    }
+};
+
+// How the cells of the b-tree file are encoded.
+enum class CellFormat {
+    // Every cell is a decimal integer padded with spaces to cellSize characters.
+    Text,
+
+    // Every cell is a little-endian integer of cellSize bytes (4 or 8),
+    // and record 0 holds a versioned header.
+    Binary
+};
+
+// How the b-tree file is accessed.
+enum class StorageBackend {
+    // Seeks, reads and writes through an fstream.
+    Stream,
+
+    // Loads and stores into a memory mapping of the file (POSIX only).
+    Mapped,
+
+    // Reads and writes at explicit offsets with pread() and pwrite() (POSIX only).
+    Positional
+};
+
+// How the buffer pool reads and writes the b-tree file in the background.
+enum class AsyncBackend {
+    // Every read and write blocks the operation that makes it.
+    None,
+
+    // An io_uring if the kernel allows it, otherwise Threads (POSIX only).
+    Uring,
+
+    // A pool of threads blocking in pread() and pwrite() (POSIX only).
+    Threads
+};
+
+// Construction-time options of a b-tree file.
+struct BTreeOptions {
+    // The encoding of the cells in the b-tree file.
+    CellFormat format = CellFormat::Text;
+
+    // The number of records the buffer pool caches in memory.
+    // 0 disables the buffer pool, so every access goes to the file.
+    int bufferPoolRecords = 0;
+
+    // How the b-tree file is accessed.
+    StorageBackend storage = StorageBackend::Stream;
+
+    // The number of pairs bulkLoad() sorts in memory before spilling a run to disk.
+    int sortRunPairs = 1 << 20;
+
+    // The number of records the b-tree file grows by when the available list runs out.
+    // 0 keeps the file at its initial number of records, so insertions fail instead.
+    int growthRecords = 0;
+
+    // Logs the writes of every operation in a redo log next to the b-tree file
+    // (with a .wal extension), so that the b-tree survives a crash.
+    // While the log exists, constructing the b-tree reopens the file and replays the log
+    // instead of starting empty.
+    bool writeAheadLog = false;
+
+    // The number of operations made durable by one write and sync of the log.
+    int groupCommitOperations = 64;
+
+    // The number of group commits after which the b-tree file is synced
+    // and the log emptied.
+    int checkpointCommits = 16;
+
+    // Reuses the b-tree file at the path instead of starting empty, after validating its header.
+    // The header of a binary file must match the order and cell size,
+    // and its number of records replaces the given one. A missing file starts empty.
+    bool openExisting = false;
+
+    // Allows the b-tree to be used from several threads at once.
+    // The Stream storage is replaced by Positional, which has no shared file position.
+    bool threadSafe = false;
+
+    // Counts the work of the b-tree and the latency of its operations for statistics().
+    bool statistics = false;
+
+    // Reads records into the buffer pool ahead of their use, and writes the dirty ones
+    // back at once, in the background. Needs the buffer pool; ignored without it.
+    // The Stream storage is replaced by Positional, whose writes are not buffered.
+    AsyncBackend asyncIO = AsyncBackend::None;
+
+    // The number of background reads and writes in flight at once.
+    int ioQueueDepth = 64;
+
+    // The number of threads of the Threads backend.
+    int ioThreads = 4;
+
+    // The number of leaves a scan reads ahead of the one it is at.
+    int prefetchLeaves = 8;
+
+    // Keeps a Bloom filter of this many bits per key of every leaf in memory,
+    // so that most searches of absent keys return without reading their leaf.
+    // The filters are rebuilt from the leaves when the b-tree is constructed.
+    // 0 disables them.
+    int bloomBitsPerKey = 0;
+
+    // Makes remove() mark the pair of the key with a tombstone in its leaf instead of
+    // taking it out, so most removals rewrite one record and rebalance nothing.
+    // Once tombstones make up more than this fraction of a leaf, they are purged
+    // from it with a single rebalance, and compact() purges them from every leaf.
+    // While it is set, the value -2 is reserved for tombstones: insert() rejects it
+    // and insertBatch() skips the pairs that carry it.
+    // 0 takes every pair out at once, and -2 is then an ordinary value.
+    double tombstoneRatio = 0;
+};
+
+// A Bloom filter of the keys of every leaf record, kept in memory.
+// A filter is unknown until it is built from its leaf, and becomes unknown again
+// whenever the record is written, so a built filter always matches its leaf.
+// Building and invalidating a filter need the latch of its record, exclusive or
+// (for building) shared; the state of a filter tells concurrent readers whether its bits are ready.
+class BloomFilters {
+public:
+    enum State : uint8_t { Unknown, Building, Built };
+
+private:
+    // The 64-bit words and the bits probed per key of each filter.
+    int words;
+    int probes;
+
+    int records = 0;
+    vector<uint64_t> bits;
+    unique_ptr<atomic<uint8_t>[]> states;
+
+    // Probes the bits at h1 + i * h2 for the two halves of the hash of a key.
+    template <class Probe>
+    void probe(uint64_t key, Probe visit) const
+    {
+        uint64_t h = mixKey(key);
+        uint32_t position = (uint32_t) h, step = (uint32_t) (h >> 32) | 1;
+        uint32_t size = (uint32_t) words * 64;
+        for (int i = 0; i < probes; ++i, position += step) visit(position % size);
+    }
+
+public:
+    // Creates unknown filters of bitsPerKey bits per key for leaves of keysPerLeaf keys.
+    BloomFilters(int bitsPerKey, int keysPerLeaf, int _records) :
+        words{max((bitsPerKey * keysPerLeaf + 63) / 64, 1)},
+        probes{max((int) (bitsPerKey * 0.69 + 0.5), 1)}
+    {
+        resize(_records);
+    }
+
+    // Changes the number of records, keeping the filters of the records that remain.
+    // Nothing else may use the filters meanwhile.
+    void resize(int count)
+    {
+        unique_ptr<atomic<uint8_t>[]> next(new atomic<uint8_t>[count]);
+        for (int i = 0; i < count; ++i)
+            next[i].store(i < records ? states[i].load(memory_order_relaxed) : (uint8_t) Unknown, memory_order_relaxed);
+        states = move(next);
+        bits.resize((size_t) count * words);
+        records = count;
+    }
+
+    // Makes every filter unknown.
+    void clear()
+    {
+        for (int i = 0; i < records; ++i) states[i].store(Unknown, memory_order_relaxed);
+    }
+
+    void invalidate(int record)
+    {
+        if (record < records) states[record].store(Unknown, memory_order_release);
+    }
+
+    // Returns false if the key is certainly not in the leaf,
+    // true if it may be or the filter is unknown.
+    bool mayContain(int record, uint64_t key) const
+    {
+        if (record >= records || states[record].load(memory_order_acquire) != Built) return true;
+        const uint64_t* filter = &bits[(size_t) record * words];
+        bool all = true;
+        probe(key, [&](uint32_t bit) { all = all && (filter[bit / 64] >> (bit % 64) & 1); });
+        return all;
+    }
+
+    // Returns true if the filter of the record is built.
+    bool built(int record) const
+    {
+        return record < records && states[record].load(memory_order_acquire) == Built;
+    }
+
+    // Builds the filter of a record from its keys. A holder of a shared latch
+    // only builds an unknown filter that no other holder is building.
+    template <class Key>
+    void build(int record, const Key* keys, int count, bool exclusive)
+    {
+        if (record >= records) return;
+        uint8_t expected = Unknown;
+        if (!exclusive && !states[record].compare_exchange_strong(expected, Building, memory_order_acquire)) return;
+        if (exclusive) states[record].store(Building, memory_order_relaxed);
+
+        uint64_t* filter = &bits[(size_t) record * words];
+        fill(filter, filter + words, 0);
+        for (int i = 0; i < count; ++i)
+            probe((uint64_t) keys[i], [&](uint32_t bit) { filter[bit / 64] |= 1ULL << (bit % 64); });
+        states[record].store(Built, memory_order_release);
+    }
+};
+
+// Holds a reader/writer latch, shared or exclusive, until it goes out of scope.
+// A null latch is not held.
+class LatchGuard {
+private:
+    shared_mutex* latch;
+    bool exclusive;
+
+public:
+    LatchGuard(shared_mutex* _latch, bool _exclusive) : latch{_latch}, exclusive{_exclusive}
+    {
+        if (!latch) return;
+        if (exclusive) latch->lock();
+        else latch->lock_shared();
+    }
+
+    ~LatchGuard()
+    {
+        if (!latch) return;
+        if (exclusive) latch->unlock();
+        else latch->unlock_shared();
+    }
+
+    LatchGuard(const LatchGuard&) = delete;
+    LatchGuard& operator=(const LatchGuard&) = delete;
+};
+
+// Lends a vector from the scratch arena of this thread until it goes out of scope.
+// The vector keeps its capacity when it is returned, so once the arena has grown
+// to the needs of an operation, the nodes decoded into its vectors cost no allocation.
+template <class T>
+class Scratch {
+private:
+    vector<T> items;
+
+    // The vectors not lent at the moment.
+    static vector<vector<T>>& arena()
+    {
+        static thread_local vector<vector<T>> free;
+        return free;
+    }
+
+public:
+    Scratch()
+    {
+        vector<vector<T>>& free = arena();
+        if (free.empty()) return;
+        items.swap(free.back());
+        free.pop_back();
+        items.clear();
+    }
+
+    ~Scratch()
+    {
+        arena().push_back(move(items));
+    }
+
+    vector<T>& operator*() { return items; }
+    vector<T>* operator->() { return &items; }
+
+    Scratch(const Scratch&) = delete;
+    Scratch& operator=(const Scratch&) = delete;
+};
+
+// Runs the tasks of a batch on a fixed set of threads, the calling thread included,
+// and rethrows the first exception a task throws once the batch is done.
+class WorkerPool {
+private:
+    vector<thread> workers;
+
+    // The batch being run: tasks calls of task, the next of which is started next.
+    function<void(int)> task;
+    int tasks = 0, next = 0, running = 0;
+    long long batch = 0;
+    exception_ptr failure;
+    bool stopping = false;
+
+    // Guards the batch; runLatch lets one batch run at a time.
+    mutex latch, runLatch;
+    condition_variable started, finished;
+
+    // Runs the tasks of the batch not started yet. Called with the latch held.
+    void take(unique_lock<mutex>& lock)
+    {
+        while (next < tasks)
+        {
+            int index = next++;
+            ++running;
+            lock.unlock();
+            exception_ptr error;
+            try
+            {
+                task(index);
+            }
+            catch (...)
+            {
+                error = current_exception();
+            }
+            lock.lock();
+            --running;
+            if (error && !failure) failure = error;
+        }
+        if (running == 0) finished.notify_all();
+    }
+
+    void work()
+    {
+        unique_lock<mutex> lock(latch);
+        long long seen = 0;
+        while (true)
+        {
+            started.wait(lock, [&] { return stopping || batch != seen; });
+            if (stopping) return;
+            seen = batch;
+            take(lock);
+        }
+    }
+
+public:
+    // Creates a pool that runs batches on the given number of threads.
+    explicit WorkerPool(int threads)
+    {
+        for (int i = 1; i < threads; ++i) workers.emplace_back([this] { work(); });
+    }
+
+    ~WorkerPool()
+    {
+        {
+            lock_guard<mutex> lock(latch);
+            stopping = true;
+        }
+        started.notify_all();
+        for (thread& worker: workers) worker.join();
+    }
+
+    // Calls body(0) .. body(count - 1) on the threads and returns when all of them are done.
+    void run(int count, function<void(int)> body)
+    {
+        lock_guard<mutex> serial(runLatch);
+        unique_lock<mutex> lock(latch);
+        task = move(body);
+        tasks = count;
+        next = 0;
+        failure = nullptr;
+        ++batch;
+        started.notify_all();
+
+        take(lock);
+        finished.wait(lock, [&] { return running == 0; });
+        tasks = 0;
+        if (failure) rethrow_exception(failure);
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+};
+
+// An immutable image of the pairs of a b-tree in memory, made by BasicBTree::freeze().
+// The keys are laid out as an implicit B+-tree (S+-tree): blocks of 64 bytes,
+// aligned to cache lines, in layers from the sorted keys up, where the children
+// of a block are found by arithmetic instead of references. A search reads one block
+// per layer and counts the keys less than its key with simdLowerBound(), which uses
+// AVX2 or SSE2 for int and int64_t keys where the processor supports them.
+// The values sit in a separate array in key order. The image can be saved to a file and mapped back read-only (POSIX),
+// in the byte order of the machine that saved it.
+// Nothing writes to an image, so any number of threads may read it at once.
+template <class Key = int, class Value = int>
+class BasicFrozenBTree {
+public:
+    using Pair = pair<Key, Value>;
+
+    // The keys in a block of 64 bytes; a block of an internal layer has one more child.
+    static constexpr int blockKeys = sizeof(Key) < 64 ? (int) (64 / sizeof(Key)) : 1;
+
+private:
+    static constexpr int imageVersion = 1;
+
+    // The first 64 bytes of an image, before its layers of keys.
+    struct Header {
+        char magic[8];
+        uint32_t version, keySize, valueSize, blockKeys;
+        int64_t count;
+        char padding[32];
+    };
+    static_assert(sizeof(Header) == 64, "the keys of an image start on a cache line");
+
+    // The image: a header, the layers of keys and the values.
+    // Allocated aligned to 64 bytes, or mapped from a saved file.
+    char* image = nullptr;
+    size_t imageSize = 0;
+    bool mapped = false;
+
+    long long count = 0;
+
+    // The keys of every layer, from the sorted keys (layer 0) up to the root block,
+    // padded with the greatest key to whole blocks, and the offset of each layer.
+    const Key* keys = nullptr;
+    vector<long long> layers, offsets;
+
+    const Value* values = nullptr;
+
+    // Sizes the layers of an image of the given number of keys.
+    void shape()
+    {
+        layers.assign(1, max((count + blockKeys - 1) / blockKeys, 1LL) * blockKeys);
+        while (layers.back() > blockKeys)
+        {
+            long long children = layers.back() / blockKeys;
+            layers.push_back((children + blockKeys) / (blockKeys + 1) * blockKeys);
+        }
+        offsets.assign(layers.size(), 0);
+        for (size_t h = 1; h < layers.size(); ++h) offsets[h] = offsets[h - 1] + layers[h - 1];
+    }
+
+    size_t keysSize() const { return (size_t) (offsets.back() + layers.back()) * sizeof(Key); }
+
+    void allocate(size_t size)
+    {
+        imageSize = size;
+        image = (char*) ::operator new[](size, align_val_t{64});
+        memset(image, 0, size);
+    }
+
+    void point()
+    {
+        keys = (const Key*) (image + sizeof(Header));
+        values = (const Value*) (image + sizeof(Header) + keysSize());
+    }
+
+    void release()
+    {
+#ifndef _WIN32
+        if (mapped && image) munmap(image, imageSize);
+        else
+#endif
+        if (image) ::operator delete[](image, align_val_t{64});
+        image = nullptr;
+    }
+
+public:
+    BasicFrozenBTree() : BasicFrozenBTree(vector<Pair>{}) {}
+
+    // Lays out the given pairs, which must be sorted by key.
+    explicit BasicFrozenBTree(const vector<Pair>& pairs) : count{(long long) pairs.size()}
+    {
+        shape();
+        allocate(sizeof(Header) + keysSize() + count * sizeof(Value));
+        point();
+
+        Header header{};
+        memcpy(header.magic, "BTFROZEN", 8);
+        header.version = imageVersion;
+        header.keySize = sizeof(Key);
+        header.valueSize = sizeof(Value);
+        header.blockKeys = blockKeys;
+        header.count = count;
+        memcpy(image, &header, sizeof(Header));
+
+        Key* layer = (Key*) keys;
+        Value* pairValues = (Value*) values;
+        for (long long i = 0; i < layers[0]; ++i) layer[i] = i < count ? pairs[i].first : numeric_limits<Key>::max();
+        for (long long i = 0; i < count; ++i) pairValues[i] = pairs[i].second;
+
+        // Key j of a block of layer h is the first key of the subtree after child j,
+        // found by descending to the leftmost block of layer 0 under it
+        for (size_t h = 1; h < layers.size(); ++h)
+            for (long long i = 0; i < layers[h]; ++i)
+            {
+                long long block = (i / blockKeys) * (blockKeys + 1) + i % blockKeys + 1;
+                for (size_t l = 1; l < h; ++l) block *= blockKeys + 1;
+                layer[offsets[h] + i] = block * blockKeys < count ? keys[block * blockKeys] : numeric_limits<Key>::max();
+            }
+    }
+
+    // Maps the image saved at the given path, or reads it where mapping is not supported.
+    explicit BasicFrozenBTree(const string& path)
+    {
+        Header header;
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) throw UnsupportedStorage(path);
+        struct stat status;
+        if (fstat(fd, &status) != 0 || status.st_size < (off_t) sizeof(Header))
+        {
+            ::close(fd);
+            throw InvalidHeader(path);
+        }
+        void* address = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED) throw UnsupportedStorage(path);
+        image = (char*) address;
+        imageSize = status.st_size;
+        mapped = true;
+#else
+        ifstream file(path, ios::binary | ios::ate);
+        if (!file.is_open()) throw UnsupportedStorage(path);
+        size_t size = (size_t) file.tellg();
+        if (size < sizeof(Header)) throw InvalidHeader(path);
+        allocate(size);
+        file.seekg(0);
+        file.read(image, size);
+#endif
+        memcpy(&header, image, sizeof(Header));
+        count = header.count;
+        bool valid = memcmp(header.magic, "BTFROZEN", 8) == 0 && header.version == imageVersion &&
+                     header.keySize == sizeof(Key) && header.valueSize == sizeof(Value) &&
+                     header.blockKeys == (uint32_t) blockKeys && count >= 0;
+        if (valid)
+        {
+            shape();
+            valid = imageSize >= sizeof(Header) + keysSize() + count * sizeof(Value);
+        }
+        if (!valid)
+        {
+            release();
+            throw InvalidHeader(path);
+        }
+        point();
+    }
+
+    BasicFrozenBTree(BasicFrozenBTree&& other) noexcept :
+        image{other.image}, imageSize{other.imageSize}, mapped{other.mapped}, count{other.count},
+        keys{other.keys}, layers{move(other.layers)}, offsets{move(other.offsets)}, values{other.values}
+    {
+        other.image = nullptr;
+    }
+
+    BasicFrozenBTree& operator=(BasicFrozenBTree&& other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            image = other.image;
+            imageSize = other.imageSize;
+            mapped = other.mapped;
+            count = other.count;
+            keys = other.keys;
+            layers = move(other.layers);
+            offsets = move(other.offsets);
+            values = other.values;
+            other.image = nullptr;
+        }
+        return *this;
+    }
+
+    ~BasicFrozenBTree()
+    {
+        release();
+    }
+
+    BasicFrozenBTree(const BasicFrozenBTree&) = delete;
+    BasicFrozenBTree& operator=(const BasicFrozenBTree&) = delete;
+
+    // Returns the number of pairs.
+    long long size() const { return count; }
+
+    // Returns the number of layers of blocks a search reads.
+    int height() const { return (int) layers.size(); }
+
+    // Returns the position in key order of the first key not less than recordId.
+    long long rank(Key recordId) const
+    {
+        // A block of layer h at key k has its children from block k / blockKeys * (blockKeys + 1)
+        // of the layer below, and the first key not less than recordId is in the child
+        // after the keys less than it
+        long long k = 0;
+        for (int h = (int) layers.size() - 1; h > 0; --h)
+            k = k * (blockKeys + 1) + (long long) simdLowerBound(keys + offsets[h] + k, blockKeys, recordId) * blockKeys;
+        return min(k + simdLowerBound(keys + k, blockKeys, recordId), count);
+    }
+
+    // Returns the value of the given key, or -1 if it is not in the image.
+    Value search(Key recordId) const
+    {
+        long long index = rank(recordId);
+        return index < count && keys[index] == recordId ? values[index] : -1;
+    }
+
+    // Walks the pairs of the image in key order.
+    class Iterator {
+    private:
+        const BasicFrozenBTree* frozen = nullptr;
+        long long index = 0;
+        Pair current;
+
+        void load()
+        {
+            if (index < frozen->count) current = {frozen->keys[index], frozen->values[index]};
+        }
+
+    public:
+        Iterator(const BasicFrozenBTree* _frozen, long long _index) : frozen{_frozen}, index{_index} { load(); }
+
+        // Returns true if the iterator points at a pair.
+        bool valid() const { return index < frozen->count; }
+
+        const Pair& operator*() const { return current; }
+        const Pair* operator->() const { return &current; }
+
+        Iterator& operator++()
+        {
+            if (index < frozen->count) ++index;
+            load();
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const { return index == other.index; }
+        bool operator!=(const Iterator& other) const { return index != other.index; }
+    };
+
+    Iterator begin() const { return Iterator(this, 0); }
+    Iterator end() const { return Iterator(this, count); }
+
+    // Returns an iterator at the first pair with a key not less than recordId.
+    Iterator lowerBound(Key recordId) const { return Iterator(this, rank(recordId)); }
+
+    // Returns an iterator at the first pair with a key greater than recordId.
+    Iterator upperBound(Key recordId) const
+    {
+        if (recordId == numeric_limits<Key>::max()) return end();
+        return Iterator(this, rank(recordId + 1));
+    }
+
+    // The pairs with keys between lo and hi (inclusive).
+    class ScanRange {
+    private:
+        Iterator first, last;
+
+    public:
+        ScanRange(Iterator _first, Iterator _last) : first{_first}, last{_last} {}
+        Iterator begin() const { return first; }
+        Iterator end() const { return last; }
+    };
+
+    // Returns the pairs with keys between lo and hi.
+    ScanRange scan(Key lo, Key hi) const
+    {
+        if (hi < lo) return ScanRange(end(), end());
+        return ScanRange(lowerBound(lo), upperBound(hi));
+    }
+
+    // Replaces the file at the given path with the image, which a reader never sees half written.
+    void save(const string& path) const
+    {
+        string nextPath = path + ".tmp";
+        {
+            ofstream next(nextPath, ios::binary | ios::trunc);
+            next.write(image, (streamsize) (sizeof(Header) + keysSize() + count * sizeof(Value)));
+            if (!next) throw UnsupportedStorage(nextPath);
+        }
+        syncPath(nextPath);
+        if (rename(nextPath.c_str(), path.c_str()) != 0) throw UnsupportedStorage(path);
+    }
+};
+
+using FrozenBTree = BasicFrozenBTree<>;
+
+// A b-tree of (Key, Value) pairs stored in a file of fixed-size records.
+// Keys and values are signed integers, whose -1 marks an empty cell
+// and, while removals leave tombstones, -2 a removed pair left in its leaf
+// (see BTreeOptions::tombstoneRatio);
+// internal nodes keep the numbers of their child records in their values.
+// An Order greater than 0 fixes the number of pairs in a node at compile time,
+// so the node buffers are arrays of that size and the record layout is constant.
+// BTree is the original b-tree of int keys and references with a runtime order.
+template <class Key = int, class Value = int, int Order = 0>
+class BasicBTree {
+    static_assert(is_integral<Key>::value && is_signed<Key>::value, "Key must be a signed integer");
+    static_assert(is_integral<Value>::value && is_signed<Value>::value, "Value must be a signed integer");
+    static_assert(sizeof(Value) >= sizeof(int), "Value must hold a record number");
+    static_assert(Order >= 0, "Order must not be negative");
+
+private:
+    // The b-tree's file path.
+    string path;
+
+    // The file that holds the b-tree nodes.
+    unique_ptr<Storage> file;
+
+    // The number of values one node can hold, which is Order if it is fixed.
+    int m;
+
+    // The number of records the b-tree file holds.
+    // It only changes when the file grows.
+    int numberOfRecords;
+
+    // The number of characters allocated for each pair
+    // in the b-tree file.
+    int cellSize;
+
+    // The encoding of the cells in the b-tree file.
+    CellFormat format;
+
+    // Caches the records of the b-tree file, or null if disabled.
+    unique_ptr<BufferPool> pool;
+
+    // The number of leaves a scan reads ahead, 0 unless the buffer pool reads in the background.
+    int prefetchLeaves = 0;
+
+    // The Bloom filters of the leaves, or null if disabled.
+    unique_ptr<BloomFilters> filters;
+
+    // The images of the records changed while snapshots are live, by record number.
+    // Each image is the record as it was before its first change after the snapshot
+    // it is tagged with, the newest at the time; the tags of a record ascend.
+    // The records are spread over shards by number, and the latch of a shard serializes
+    // the reads of snapshots with the writes of its records while snapshots are live.
+    struct VersionShard {
+        mutex latch;
+        unordered_map<int, vector<pair<long long, vector<char>>>> images;
+    };
+    static const int versionShards = 64;
+    VersionShard versions[versionShards];
+    atomic<long long> versionImages{0};
+
+    // The epochs of the live snapshots, and the epoch of the newest snapshot taken.
+    set<long long> liveSnapshots;
+    long long latestSnapshot = 0;
+
+    // True while a snapshot is live, so that writes keep the images it needs.
+    atomic<bool> snapshotting{false};
+
+    // Guards the snapshot epochs: held shared by writes that keep images,
+    // and exclusively to take or release a snapshot.
+    shared_mutex snapshotLatch;
+
+    // The b-tree and the epoch of the snapshot that reads on this thread go through.
+    inline static thread_local pair<const void*, long long> readingSnapshot{nullptr, 0};
+
+    // The progress of an online compaction between the calls of compact().
+    struct Compaction {
+        enum Phase { Idle, Purge, Repack, Count, Prepare, Relocate, Trim, Finish };
+        Phase phase = Idle;
+
+        // The records visited by a step of the passes over the b-tree file.
+        static const int recordsPerStep = 128;
+
+        // The pairs a repacked node is filled with.
+        int capacity = 0;
+
+        // While repacking, the parents being repacked are this many levels above
+        // the parents of the leaves; while relocating, the nodes being moved
+        // are this many levels below the root.
+        int level = 0;
+
+        // The maximum key of the last node visited at the level, if started.
+        Key last{};
+        bool started = false;
+
+        // The record the next node in breadth-first order is moved to.
+        int position = 2;
+
+        // Empty records kept out of the available list for the nodes to move into.
+        set<int> holes;
+
+        // The next record a pass over the b-tree file visits.
+        int cursor = 0;
+
+        // While counting, the records of the file that hold nodes, and those at the start of it
+        // that the nodes fill once they are moved; the empty ones among them become holes.
+        int nodes = 0;
+
+        // While trimming, the records before the first one of the end of the file
+        // left without nodes, and the last record allocated meanwhile.
+        int kept = 0, allocated = 0;
+
+        // True while the pass puts the empty records back in the available list,
+        // which then holds only those freed meanwhile and the records after the pass.
+        bool linking = false;
+
+        // The records before the cursor freed since the pass began linking,
+        // which are in the available list already.
+        set<int> freed;
+    };
+    Compaction compaction;
+
+    // The number of pairs bulkLoad() sorts in memory at once.
+    int sortRunPairs;
+
+    // The number of records the b-tree file grows by, or 0 if it does not grow.
+    int growthRecords;
+
+    // The fraction of tombstones past which a leaf is purged, or 0 if removals leave none.
+    double tombstoneRatio;
+
+    // The number of records at the start of the b-tree file that were written.
+    // The records after them are empty records of the initial available list,
+    // which are only written when they are used.
+    atomic<int> writtenRecords{0};
+
+    // Latches the whole b-tree, or null if it is not thread-safe.
+    // Operations that only touch one leaf hold it shared,
+    // and operations that restructure the b-tree hold it exclusively.
+    unique_ptr<shared_mutex> treeLatch;
+
+    // One reader/writer latch per record, or null if the b-tree is not thread-safe.
+    unique_ptr<shared_mutex[]> recordLatches;
+
+    // The redo log of the b-tree, or null if it is disabled.
+    unique_ptr<WriteAheadLog> log;
+
+    // False while writes bypass the log, during bulk loads.
+    bool logging = true;
+
+    // The images of the records written by logged operations since the last group commit.
+    // They reach the b-tree file only once the log holds them,
+    // so a crash never leaves part of an operation in the file.
+    unordered_map<int, vector<char>> unappliedRecords;
+
+    // Serializes the log and the commit counters.
+    mutex logLatch;
+
+    // Guards unappliedRecords: held shared by reads, which probe it for every cell,
+    // and exclusively by the writes that change it, after the log latch.
+    shared_mutex unappliedLatch;
+
+    // The number of the next logged operation.
+    atomic<long long> nextOperation{1};
+
+    // The number of the logged operation running on this thread.
+    inline static thread_local long long currentOperation = 0;
+
+    // The operations ended since the last group commit, and the group commits so far.
+    atomic<int> uncommittedOperations{0};
+    long long commits = 0;
+
+    int groupCommitOperations;
+    int checkpointCommits;
+
+    // The counters of statistics(), or null if they are disabled.
+    unique_ptr<BTreeCounters> counters;
+
+    // The operation running on this thread, which the nodes it reads and writes count for.
+    inline static thread_local BTreeCounters::Operation countedOperation = BTreeCounters::OtherOperation;
+
+public:
+    // A (key, value) pair of a node.
+    using Pair = pair<Key, Value>;
+
+    // A record on the path from the root, with the index of the child taken.
+    using Path = pair<int, int>;
+
+    // The value of a removed pair left in its leaf until the leaf is purged.
+    static constexpr Value tombstone = -2;
+
+    // The sorted pairs of a node, held in a vector, an array or a part of either,
+    // which the view does not own.
+    class NodeView {
+    private:
+        const Pair* first = nullptr;
+        int count = 0;
+
+    public:
+        NodeView() = default;
+        NodeView(const vector<Pair>& pairs) : first{pairs.data()}, count{(int) pairs.size()} {}
+        NodeView(const Pair* _first, int _count) : first{_first}, count{_count} {}
+
+        const Pair* begin() const { return first; }
+        const Pair* end() const { return first + count; }
+        int size() const { return count; }
+        bool empty() const { return count == 0; }
+        const Pair& operator[](int index) const { return first[index]; }
+        const Pair& back() const { return first[count - 1]; }
+    };
+
+    // Identifies a binary b-tree file ("BTRE").
+    static const int headerMagic = 0x45525442;
+
+    // The version of the binary file layout.
+    // Version 2 added the leaf links.
+    static const int headerVersion = 2;
+
+    // The cells of record 0 that hold the binary header.
+    // Cell 0 is the empty status and cell 1 the head of the available list.
+    enum HeaderCell { MagicCell = 2, VersionCell, OrderCell, CellSizeCell, RecordsCell, HeaderCells };
+
+    // Returns the number of characters a record in the b-tree file takes
+    // based on the specified pair size and number of values that one record can hold.
+    int recordSize() const { return cellsPerRecord() * cellSize; }
+
+    // Returns the number of cells in a record: the leaf status, the pairs,
+    // and in the binary format the links to the neighbouring leaves.
+    int cellsPerRecord() const { return 1 + 2 * order() + (hasLeafLinks() ? 2 : 0); }
+
+    // Returns the number of pairs one node can hold.
+    // A fixed Order is a constant, so the offsets computed from it fold.
+    int order() const { return Order > 0 ? Order : m; }
+
+    // Returns true if leaf records hold links to their neighbouring leaves.
+    // The text format keeps the original record layout without them.
+    bool hasLeafLinks() const { return format == CellFormat::Binary; }
+
+    // Returns the cell that holds the number of the next leaf.
+    int nextLeafCell() const { return 2 * order() + 1; }
+
+    // Returns the cell that holds the number of the previous leaf.
+    int previousLeafCell() const { return 2 * order() + 2; }
+
+    // Returns the number of characters a pair values takes in a record
+    // based on the specified pair size.
+    int pairSize() const
+     { return 2 * cellSize; }
+    // Initializes the b-tree file with the maximum number of
+    // records it can hold, and the maximum number of values
+    // one record can hold, and the size of each pair in the b-tree file.
+    BasicBTree(string _path, int _numberOfRecords, int _m, int _cellSize, BTreeOptions options = {}) :
+    path{move(_path)},
+        m{_m},
+        numberOfRecords{_numberOfRecords},
+        cellSize{_cellSize},
+        format{options.format},
+        sortRunPairs{max(options.sortRunPairs, 1)},
+        growthRecords{max(options.growthRecords, 0)},
+        tombstoneRatio{max(options.tombstoneRatio, 0.0)},
+        groupCommitOperations{max(options.groupCommitOperations, 1)},
+        checkpointCommits{max(options.checkpointCommits, 1)}
+    {
+        if (Order > 0 && _m != Order) throw InvalidOrder(_m);
+        if (format == CellFormat::Binary)
+        {
+            // Binary cells are native 32-bit or 64-bit integers wide enough for the keys and values
+            if (cellSize != 4 && cellSize != 8) throw InvalidCellSize(cellSize);
+            if (cellSize < (int) sizeof(Key) || cellSize < (int) sizeof(Value)) throw InvalidCellSize(cellSize);
+
+            // Record 0 must be wide enough to hold the header
+            if (cellsPerRecord() < HeaderCells) throw InvalidOrder(order());
+        }
+        if (options.statistics) counters.reset(new BTreeCounters);
+        if (options.threadSafe)
+        {
+            treeLatch.reset(new shared_mutex);
+            recordLatches.reset(new shared_mutex[numberOfRecords + 1]);
+            if (options.storage == StorageBackend::Stream) options.storage = StorageBackend::Positional;
+        }
+        bool async = options.asyncIO != AsyncBackend::None && options.bufferPoolRecords > 0;
+        if (async && options.storage == StorageBackend::Stream) options.storage = StorageBackend::Positional;
+
+        // A logged b-tree is reopened and the operations committed to its log replayed,
+        // otherwise the b-tree starts empty
+        vector<WriteAheadLog::Entry> entries;
+        bool reopening = false;
+        if (options.writeAheadLog)
+        {
+            log.reset(new WriteAheadLog(path + ".wal"));
+            reopening = log->read(entries);
+        }
+
+        openFile(options.storage, !reopening && !options.openExisting);
+        findWrittenRecords();
+        if (reopening) recover(entries);
+        else if (!options.openExisting || !readHeader())
+        {
+            initialize();
+            if (log) file->sync();
+        }
+        resetLog();
+
+        if (options.bufferPoolRecords > 0)
+            pool.reset(new BufferPool(options.bufferPoolRecords, recordSize(),
+                [this](int recordNumber, char* record) { readRecord(recordNumber, record); },
+                [this](int recordNumber, const char* record) { writeRecord(recordNumber, record); },
+                async ? openAsync(options) : nullptr));
+        if (pool && pool->async()) prefetchLeaves = max(options.prefetchLeaves, 0);
+        if (options.bloomBitsPerKey > 0)
+        {
+            filters.reset(new BloomFilters(options.bloomBitsPerKey, order(), numberOfRecords + 1));
+            rebuildFilters();
+        }
+    }
+
+    // Writes back the cached records and closes the b-tree file.
+    ~BasicBTree()
+    {
+        releaseHoles();
+        if (log) checkpoint();
+        flush();
+    }
+
+    // Writes every modified record cached in memory to the b-tree file.
+    void flush()
+    {
+        if (log) commit();
+        if (pool) pool->flush();
+        file->flush();
+    }
+
+    // Writes every modified record to the b-tree file
+    // and blocks until the file reaches the disk.
+    void sync()
+    {
+        if (log)
+        {
+            checkpoint();
+            return;
+        }
+        if (pool) pool->flush();
+        file->sync();
+    }
+
+    // Makes the operations ended so far durable with one write and sync of the log,
+    // then applies their records to the b-tree file.
+    void commit()
+    {
+        LatchGuard exclusive(treeLatch.get(), true);
+        commitLog(false);
+    }
+
+    // Commits the logged operations, syncs the b-tree file and empties the log.
+    void checkpoint()
+    {
+        LatchGuard exclusive(treeLatch.get(), true);
+        commitLog(true);
+    }
+
+    // Brackets one logged operation. Its writes are tagged with a new operation number,
+    // end() appends its commit entry while the operation still holds its latches,
+    // and the group is committed once they are released, if it is due.
+    class Operation {
+    private:
+        BasicBTree& tree;
+        bool ended = false;
+
+    public:
+        explicit Operation(BasicBTree& _tree) : tree{_tree}
+        {
+            if (tree.log) currentOperation = tree.nextOperation++;
+        }
+
+        ~Operation()
+        {
+            end();
+            if (tree.log && tree.uncommittedOperations >= tree.groupCommitOperations) tree.commit();
+        }
+
+        void end()
+        {
+            if (ended) return;
+            ended = true;
+            tree.endOperation();
+        }
+
+        // Ends the operation and returns its result.
+        template <class Result>
+        Result end(Result result)
+        {
+            end();
+            return result;
+        }
+
+        Operation(const Operation&) = delete;
+        Operation& operator=(const Operation&) = delete;
+    };
+
+    // Counts one insert, search or remove and its latency, if statistics are kept.
+    // The nodes read and written on this thread meanwhile count for it.
+    class CountedOperation {
+    private:
+        BTreeCounters* counters;
+        BTreeCounters::Operation operation, previous;
+        chrono::steady_clock::time_point start;
+
+    public:
+        CountedOperation(BasicBTree& tree, BTreeCounters::Operation _operation) :
+            counters{tree.counters.get()}, operation{_operation}, previous{countedOperation}
+        {
+            if (!counters) return;
+            countedOperation = operation;
+            start = chrono::steady_clock::now();
+        }
+
+        ~CountedOperation()
+        {
+            if (!counters) return;
+            countedOperation = previous;
+            counters->record(operation, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        }
+
+        CountedOperation(const CountedOperation&) = delete;
+        CountedOperation& operator=(const CountedOperation&) = delete;
+    };
+
+    // Returns the statistics of the b-tree so far. The counts of nodes, splits, merges,
+    // allocations and operations stay 0 unless BTreeOptions::statistics is set.
+    BTreeStatistics statistics()
+    {
+        BTreeStatistics stats;
+        stats.seeks = file->seeks();
+        stats.bytesRead = file->bytesRead();
+        stats.bytesWritten = file->bytesWritten();
+        if (pool)
+        {
+            stats.poolHits = pool->hits();
+            stats.poolMisses = pool->misses();
+            stats.poolPrefetches = pool->prefetches();
+        }
+        {
+            LatchGuard shared(treeLatch.get(), false);
+            stats.height = height();
+        }
+        stats.snapshotImages = versionImages.load(memory_order_relaxed);
+        if (!counters) return stats;
+
+        auto load = [](const atomic<long long>& counter) { return counter.load(memory_order_relaxed); };
+        const char* names[] = {"insert", "search", "remove"};
+        for (int i = 0; i < BTreeCounters::Operations; ++i)
+        {
+            const BTreeCounters::OperationCounters& counted = counters->operations[i];
+            stats.nodeReads += load(counted.nodeReads);
+            stats.nodeWrites += load(counted.nodeWrites);
+            if (i == BTreeCounters::OtherOperation) continue;
+
+            BTreeStatistics::Operation operation;
+            operation.name = names[i];
+            operation.count = load(counted.count);
+            operation.nodeReads = load(counted.nodeReads);
+            operation.nodeWrites = load(counted.nodeWrites);
+            operation.latencyNanos = load(counted.latencyNanos);
+            for (const auto& latency: counted.latencies) operation.latencies.push_back(load(latency));
+            stats.operations.push_back(move(operation));
+        }
+        stats.nodeSplits = load(counters->nodeSplits);
+        stats.rootSplits = load(counters->rootSplits);
+        stats.merges = load(counters->merges);
+        stats.redistributions = load(counters->redistributions);
+        stats.allocations = load(counters->allocations);
+        stats.frees = load(counters->frees);
+        stats.bloomNegatives = load(counters->bloomNegatives);
+        stats.bloomFalsePositives = load(counters->bloomFalsePositives);
+        return stats;
+    }
+
+    // Returns the number of levels of the b-tree, or 0 if it holds no pairs,
+    // following the first child of every internal node.
+    int height()
+    {
+        if (isEmpty(1) || cell(1, 2) == -1) return 0;
+        int levels = 1;
+        for (int i = 1; !isLeaf(i); ++levels) i = cell(i, 2);
+        return levels;
+    }
+
+    // Returns the buffer pool of the b-tree, or null if it is disabled.
+    const BufferPool* bufferPool() const { return pool.get(); }
+
+    // Returns the file of the b-tree.
+    const Storage& storage() const { return *file; }
+
+    // Returns the number of records the b-tree file holds.
+    int records() const { return numberOfRecords; }
+
+    //  Inserts a new value in the b-tree.
+    //  Returns the index of the record in the b-tree file.
+    //  Returns -1 if insertion failed.
+    //  Insertion fails if there are no enough empty
+    //  records to complete the insertion, or if removals
+    //  leave tombstones and the reference is the tombstone -2.
+    int insert(Key recordId, Value reference)
+    {
+        if (isTombstone(reference)) return -1;
+        CountedOperation counted(*this, BTreeCounters::InsertOperation);
+        Operation operation(*this);
+        if (!treeLatch) return operation.end(insertExclusive(recordId, reference));
+
+        // Most insertions only touch their leaf, so try that with the b-tree latched shared
+        {
+            LatchGuard shared(treeLatch.get(), false);
+            int leaf = insertInLeaf(recordId, reference);
+            if (leaf != -1) return operation.end(leaf);
+        }
+
+        LatchGuard exclusive(treeLatch.get(), true);
+        return operation.end(insertExclusive(recordId, reference));
+    }
+
+    // Inserts a new value in the b-tree, which the caller holds exclusively.
+    int insertExclusive(Key recordId, Value reference)
+    {
+        // If the root is empty
+        if (isEmpty(1))
+        {
+            // Insert in root
+
+            // Take the root out of the available list, where it is at the head
+            // unless a compaction put other records in front of it
+            takeEmpty(1);
+            count(&BTreeCounters::allocations);
+
+            // Create the node
+            vector<Pair> current = node(1);
+
+            // Insert the new pair
+            current.emplace_back(recordId, reference);
+
+            // Sort the node
+            sort(current.begin(), current.end());
+
+            // Write the node in root
+            writeNode(current, 1);
+
+            // Mark the root as leaf
+            markLeaf(1, 0);
+
+            // Return the index of the record in which the insertion happened
+            // i.e. the root in this case
+            return 1;
+        }
+
+        // Keep track of visited records to updateAfterInsert them after insertion
+        Scratch<int> visited;
+
+        // Search for recordId in every node in the b-tree
+        // starting with the root
+        int i = 1;
+        while (!isLeaf(i))
+        {
+            visited->push_back(i);
+
+            // B-Tree traversal
+            i = childFor(i, recordId);
+        }
+
+        Scratch<Pair> current;
+        node(i, *current);
+        if (reviveTombstone(*current, recordId, reference))
+        {
+            writeNode(*current, i);
+            return i;
+        }
+
+        // Insert the new pair in order
+        Pair p{recordId, reference};
+        auto position = current->insert(upper_bound(current->begin(), current->end(), p), p);
+        bool newMaximum = position + 1 == current->end();
+
+        SeparatorChanges changes;
+
+        // If record overflowed after insertion
+        if ((int) current->size() > order())
+            changes = split(i, *current);
+        else
+        {
+            // Write the node in root
+            writeNode(*current, i);
+
+            // The entry of the record in its parent only changes with its maximum
+            if (newMaximum) changes.push_back({i, current->back().first, SeparatorChange::Updated});
+        }
+
+        // If the insertion happened in root
+        // Then there are no parents to updateAfterInsert
+        if (i == 1) return i;
+
+        // Otherwise, updateAfterInsert parents
+        // until one of them is left unchanged
+        while (!visited->empty() && !changes.empty())
+        {
+            int lastVisitedIndex = visited->back();
+            visited->pop_back();
+
+            changes = updateAfterInsert(lastVisitedIndex, changes);
+        }
+
+        // Return the index of the inserted record
+        // or -1 if insertion failed
+        return i;
+    }
+
+    // Inserts a batch of (recordId, reference) pairs in the b-tree.
+    // The batch is sorted, and every run of pairs that belongs to the same leaf
+    // is applied with one descent and one write of each affected ancestor.
+    // Returns the number of pairs inserted, which is less than the batch size
+    // if there are no enough empty records to insert the rest. If removals
+    // leave tombstones, pairs whose reference is the tombstone -2 are skipped.
+    template <class InputIterator>
+    int insertBatch(InputIterator first, InputIterator last)
+    {
+        vector<Pair> batch;
+        for (; first != last; ++first)
+            if (!isTombstone(first->second)) batch.emplace_back(first->first, first->second);
+        sort(batch.begin(), batch.end());
+
+        Operation operation(*this);
+        LatchGuard exclusive(treeLatch.get(), true);
+        prefetchDescents(batch);
+
+        int inserted = 0;
+        size_t position = 0;
+
+        // An empty root takes the first pair the usual way
+        if (!batch.empty() && isEmpty(1))
+        {
+            insertExclusive(batch[0].first, batch[0].second);
+            ++inserted;
+            ++position;
+        }
+
+        Key keys[Order > 0 ? Order : m];
+        Value references[Order > 0 ? Order : m];
+        while (position < batch.size())
+        {
+            // Descend to the leaf of the next pair, remembering the path
+            // and the largest key that still belongs to that leaf
+            vector<BatchStep> path;
+            Key bound = numeric_limits<Key>::max();
+            int i = 1;
+            while (true)
+            {
+                int status;
+                int count = decodeRecord(i, status, keys, references);
+                if (status == 0) break;
+
+                int child = keyLowerBound(keys, count, batch[position].first);
+                if (child < count - 1) bound = min(bound, keys[child]);
+                if (child == count) --child;
+                path.push_back({i, child, count});
+                i = (int) references[child];
+            }
+
+            size_t end = position;
+            while (end < batch.size() && batch[end].first <= bound) ++end;
+
+            // Take fewer pairs if their splits need more records than are empty
+            vector<Pair> leaf = node(i);
+            while (!ensureEmptyRecords(recordsNeeded(path, (int) (leaf.size() + end - position))))
+            {
+                if (end - position == 1) return operation.end(inserted);
+                end = position + (end - position) / 2;
+            }
+
+            // A pair of the batch takes the place of the tombstone of its key
+            auto batchFirst = batch.begin() + position, batchLast = batch.begin() + end;
+            leaf.erase(std::remove_if(leaf.begin(), leaf.end(), [&](const Pair& p) {
+                return isTombstone(p.second) && binary_search(batchFirst, batchLast, p,
+                                                              [](const Pair& a, const Pair& b) { return a.first < b.first; });
+            }), leaf.end());
+
+            vector<Pair> merged;
+            merged.reserve(leaf.size() + end - position);
+            std::merge(leaf.begin(), leaf.end(), batch.begin() + position, batch.begin() + end, back_inserter(merged));
+            inserted += (int) (end - position);
+            position = end;
+
+            // Write the leaf, then replace the entry of each changed node in its parent
+            // until an ancestor neither splits nor changes its maximum
+            vector<Pair> entries = writeSpread(i, 0, merged);
+            while (!path.empty())
+            {
+                BatchStep step = path.back();
+                path.pop_back();
+
+                vector<Pair> parent = node(step.record);
+                if (entries.size() == 1 && parent[step.child] == entries[0]) break;
+
+                parent.erase(parent.begin() + step.child);
+                parent.insert(parent.begin() + step.child, entries.begin(), entries.end());
+                entries = writeSpread(step.record, 1, parent);
+            }
+        }
+        return operation.end(inserted);
+    }
+
+    // Searches for the node with the given value.
+    // Returns the index of the record in the b-tree.
+    // Returns -1 if the given value is not found in any node.
+    Value search(Key recordId)
+    {
+        CountedOperation counted(*this, BTreeCounters::SearchOperation);
+        LatchGuard shared(treeLatch.get(), false);
+
+        Key keys[Order > 0 ? Order : m];
+        Value references[Order > 0 ? Order : m];
+
+        // Search for recordId in every node in the b-tree
+        // starting with the root, reading each record once
+        // and latching each child before releasing its parent
+        int i = 1;
+        bool filtered = false;
+        latchRecord(i, false);
+        while (true)
+        {
+            int status;
+            int count = decodeRecord(i, status, keys, references);
+            int index = keyLowerBound(keys, count, recordId);
+
+            // The first key not less than recordId in a leaf is the only candidate
+            if (status != 1)
+            {
+                if (filtering() && status == 0) filters->build(i, keys, count, false);
+                unlatchRecord(i, false);
+                if (status == -1) return -1;
+                while (index < count && keys[index] == recordId && isTombstone(references[index])) ++index;
+                if (index < count && keys[index] == recordId) return references[index];
+                if (filtered) this->count(&BTreeCounters::bloomFalsePositives);
+                return -1;
+            }
+
+            // B-Tree traversal: the first greater value, or the last one
+            int child = (int) references[index < count ? index : count - 1];
+            latchRecord(child, false);
+            unlatchRecord(i, false);
+            i = child;
+
+            // A leaf whose filter rules recordId out is not read
+            if (filtering() && filters->built(i))
+            {
+                if (!filters->mayContain(i, (uint64_t) recordId))
+                {
+                    unlatchRecord(i, false);
+                    this->count(&BTreeCounters::bloomNegatives);
+                    return -1;
+                }
+                filtered = true;
+            }
+        }
+    }
+
+    // The fewest keys searchMany() gives each of its threads.
+    static const int searchManyKeysPerThread = 4096;
+
+    // Searches for every given key and returns their values in the same order,
+    // -1 for the keys not found. The keys are sorted and looked up together level by level,
+    // so every node on their paths is read once per call rather than once per key.
+    // Large sets are split between up to the given number of threads,
+    // each with a contiguous part of the sorted keys, if the b-tree is thread-safe.
+    vector<Value> searchMany(const Key* keys, size_t count, int threads = 1)
+    {
+        vector<pair<Key, size_t>> probes(count);
+        for (size_t i = 0; i < count; ++i) probes[i] = {keys[i], i};
+        sort(probes.begin(), probes.end());
+
+        vector<Value> values(count, -1);
+        int parts = treeLatch ? (int) min((size_t) max(threads, 1), max(count / searchManyKeysPerThread, (size_t) 1)) : 1;
+        if (parts == 1) searchSorted(probes, 0, count, values);
+        else
+        {
+            WorkerPool workers(parts);
+            workers.run(parts, [&](int part) {
+                searchSorted(probes, count * part / parts, count * (part + 1) / parts, values);
+            });
+        }
+        return values;
+    }
+
+    vector<Value> searchMany(const vector<Key>& keys, int threads = 1)
+    {
+        return searchMany(keys.data(), keys.size(), threads);
+    }
+
+    // Prints the b-tree file in a table format.
+    void display()
+    {
+        LatchGuard exclusive(treeLatch.get(), true);
+        printRecords(numberOfRecords);
+    }
+
+    // Prints the given number of records from the start of the b-tree file.
+    void printRecords(int count)
+    {
+         // For each record
+        for (int i = 0; i < count; ++i)
+        {
+            // Read the record
+            char record[recordSize()];
+            readBytes(i, 0, record, recordSize());
+
+            // Binary cells are not printable, so print their decoded values
+            if (format == CellFormat::Binary)
+            {
+                for (int c = 0; c < cellsPerRecord(); ++c)
+                {
+                    string value = to_string(decodeCell(record + c * cellSize));
+                    cout << value << string(value.size() < 6 ? 6 - value.size() : 1, ' ');
+                }
+            }
+            else
+            // Instead of printing the array of characters,
+            // print each character one by one to avoid weird null-terminator issue
+            for (char r: record) cout << r;
+
+            cout << '\n';
+        }
+    }
+
+    // Searches for and removes the given value from the b-tree,
+    // or marks it with a tombstone if tombstoneRatio is set.
+    void remove(Key recordId)
+    {
+        CountedOperation counted(*this, BTreeCounters::RemoveOperation);
+        Operation operation(*this);
+        if (!treeLatch)
+        {
+            removeExclusive(recordId);
+            operation.end();
+            return;
+        }
+
+        // Most removals only touch their leaf, so try that with the b-tree latched shared
+        {
+            LatchGuard shared(treeLatch.get(), false);
+            if (removeInLeaf(recordId))
+            {
+                operation.end();
+                return;
+            }
+        }
+
+        LatchGuard exclusive(treeLatch.get(), true);
+        removeExclusive(recordId);
+        operation.end();
+    }
+
+    // Removes the given value from the b-tree, which the caller holds exclusively.
+    void removeExclusive(Key recordId)
+    {
+        // If the root is empty
+        if (isEmpty(1)) return;
+
+        // Keep track of visited records to updateAfterInsert them after insertion
+        Scratch<int> visited;
+
+        // Search for recordId in every node in the b-tree
+        // starting with the root
+        int currentRecordNumber = 1, parentRecordNumber = -1;
+        while (!isLeaf(currentRecordNumber)) {
+            visited->push_back(currentRecordNumber);
+
+            // B-Tree traversal
+            parentRecordNumber = currentRecordNumber;
+            currentRecordNumber = childFor(currentRecordNumber, recordId);
+        }
+
+        Scratch<Pair> current;
+        node(currentRecordNumber, *current);
+        auto pair = livePair(*current, recordId);
+
+        // A tombstone keeps the maximum key of the leaf, so nothing above it changes
+        // until the tombstones of the leaf are purged together
+        if (tombstoneRatio > 0)
+        {
+            if (pair == current->end()) return;
+            pair->second = tombstone;
+            if (!overTombstoneRatio(*current))
+            {
+                writeNode(*current, currentRecordNumber);
+                return;
+            }
+            dropTombstones(*current);
+            updateAncestors(*visited, writePurged(parentRecordNumber, currentRecordNumber, *current));
+            return;
+        }
+
+        // Delete first pair with first == recordId
+        if (pair != current->end()) current->erase(pair);
+
+        SeparatorChanges changes = writeOrRebalance(parentRecordNumber, currentRecordNumber, *current);
+        updateAncestors(*visited, changes);
+    }
+
+    // Makes the reads of this thread go through the snapshot with the given epoch
+    // until it goes out of scope. Epoch 0 leaves them as they are.
+    class ReadingSnapshot {
+    private:
+        pair<const void*, long long> previous;
+        bool active;
+
+    public:
+        ReadingSnapshot(const BasicBTree* tree, long long epoch) : previous{readingSnapshot}, active{epoch != 0}
+        {
+            if (active) readingSnapshot = {tree, epoch};
+        }
+
+        ~ReadingSnapshot()
+        {
+            if (active) readingSnapshot = previous;
+        }
+
+        ReadingSnapshot(const ReadingSnapshot&) = delete;
+        ReadingSnapshot& operator=(const ReadingSnapshot&) = delete;
+    };
+
+    // Walks the pairs of the b-tree in key order, one leaf at a time.
+    // In the binary format the leaves are followed through their links;
+    // in the text format through the path from the root.
+    // Modifying the b-tree invalidates its iterators.
+    class Iterator {
+    private:
+        friend class BasicBTree;
+
+        BasicBTree* tree = nullptr;
+
+        // The current leaf and its pairs.
+        int leaf = -1;
+        vector<Pair> pairs;
+
+        // The index of the current pair, which is pairs.size() past the last pair
+        // and -1 before the first one.
+        int index = 0;
+
+        // The internal records from the root to the leaf, with the index of the child taken.
+        // Only kept when the leaves are not linked.
+        vector<Path> path;
+
+        // The number of leaves after the current one being read ahead.
+        int prefetched = 0;
+
+        // The epoch of the snapshot the iterator reads, or 0 for the current b-tree.
+        long long snapshot = 0;
+
+        // Moves to the leaf after or before the current one, skipping empty leaves.
+        // Returns false, staying at the current leaf, if there is none.
+        bool moveLeaf(bool forward)
+        {
+            // An empty b-tree has no leaf to move from
+            if (leaf == -1) return false;
+
+            int current = leaf;
+            vector<Path> savedPath = path;
+            vector<Pair> currentPairs;
+            do
+            {
+                if (tree->hasLeafLinks())
+                    current = forward ? tree->nextLeaf(current) : tree->previousLeaf(current);
+                else
+                    current = tree->siblingLeaf(path, forward);
+
+                if (current == -1)
+                {
+                    path.swap(savedPath);
+                    return false;
+                }
+                currentPairs = tree->leafNode(current);
+                tree->dropTombstones(currentPairs);
+
+                // A leaf split by another thread since the current leaf was read
+                // hands over pairs that were already visited, so skip them
+                if (!pairs.empty() && forward)
+                    currentPairs.erase(currentPairs.begin(),
+                                       upper_bound(currentPairs.begin(), currentPairs.end(), pairs.back()));
+                else if (!pairs.empty())
+                    currentPairs.erase(lower_bound(currentPairs.begin(), currentPairs.end(), pairs.front()),
+                                       currentPairs.end());
+            } while (currentPairs.empty());
+
+            leaf = current;
+            pairs.swap(currentPairs);
+
+            // Keep the next leaves in flight once half of those read ahead are used
+            if (forward && tree->prefetchLeaves > 0 && --prefetched <= tree->prefetchLeaves / 2)
+                prefetched = tree->prefetchLeavesAfter(pairs.back().first);
+            return true;
+        }
+
+    public:
+        // Returns true if the iterator points at a pair.
+        bool valid() const { return index >= 0 && index < (int) pairs.size(); }
+
+        const Pair& operator*() const { return pairs[index]; }
+        const Pair* operator->() const { return &pairs[index]; }
+
+        // Moves to the next pair, or past the last pair.
+        Iterator& operator++()
+        {
+            if (index >= (int) pairs.size()) return *this;
+            if (++index < (int) pairs.size()) return *this;
+
+            LatchGuard shared(tree->treeLatch.get(), false);
+            ReadingSnapshot reading(tree, snapshot);
+            if (moveLeaf(true)) index = 0;
+            return *this;
+        }
+
+        // Moves to the previous pair, or before the first pair.
+        Iterator& operator--()
+        {
+            if (index < 0) return *this;
+            if (--index > -1) return *this;
+
+            LatchGuard shared(tree->treeLatch.get(), false);
+            ReadingSnapshot reading(tree, snapshot);
+            if (moveLeaf(false)) index = (int) pairs.size() - 1;
+            return *this;
+        }
+    };
+
+    // The pairs with keys between lo and hi (inclusive),
+    // streamed in key order by a range-based for loop.
+    class ScanRange {
+    private:
+        Iterator first;
+        Key hi;
+
+    public:
+        struct End {};
+
+        class Position {
+        private:
+            Iterator it;
+            Key hi;
+        public:
+            Position(Iterator _it, Key _hi) : it{move(_it)}, hi{_hi} {}
+            const Pair& operator*() const { return *it; }
+            Position& operator++() { ++it; return *this; }
+            bool operator!=(End) const { return it.valid() && it->first <= hi; }
+        };
+
+        ScanRange(Iterator _first, Key _hi) : first{move(_first)}, hi{_hi} {}
+        Position begin() const { return Position(first, hi); }
+        End end() const { return End{}; }
+    };
+
+    // Returns an iterator at the first pair with a key not less than recordId.
+    Iterator lowerBound(Key recordId)
+    {
+        return seek(recordId, true);
+    }
+
+    // Returns an iterator at the first pair with a key greater than recordId.
+    // Stepping it back walks the pairs not greater than recordId in descending order.
+    Iterator upperBound(Key recordId)
+    {
+        return seek(recordId, false);
+    }
+
+    // Returns the pairs with keys between lo and hi.
+    ScanRange scan(Key lo, Key hi)
+    {
+        return ScanRange(lowerBound(lo), hi);
+    }
+
+    // The b-tree as it was when snapshot() took it. Reads through a snapshot
+    // do not see the changes made since, whose records keep their earlier images
+    // in memory until no live snapshot needs them. They hold the b-tree latch shared
+    // for one descent or one leaf at a time but take no record latches,
+    // so writers in the leaves run alongside them.
+    // The iterators of a snapshot are valid while it lives.
+    class Snapshot {
+    private:
+        friend class BasicBTree;
+
+        BasicBTree* tree = nullptr;
+        long long epoch = 0;
+
+        // The number of records of the b-tree file when the snapshot was taken.
+        int numberOfRecords = 0;
+
+        Snapshot(BasicBTree* _tree, long long _epoch, int _numberOfRecords) :
+            tree{_tree}, epoch{_epoch}, numberOfRecords{_numberOfRecords} {}
+
+    public:
+        Snapshot(Snapshot&& other) noexcept :
+            tree{other.tree}, epoch{other.epoch}, numberOfRecords{other.numberOfRecords}
+        {
+            other.tree = nullptr;
+        }
+
+        Snapshot& operator=(Snapshot&& other) noexcept
+        {
+            if (this != &other)
+            {
+                release();
+                tree = other.tree;
+                epoch = other.epoch;
+                numberOfRecords = other.numberOfRecords;
+                other.tree = nullptr;
+            }
+            return *this;
+        }
+
+        ~Snapshot()
+        {
+            release();
+        }
+
+        // Lets the b-tree reclaim the images only this snapshot needs.
+        void release()
+        {
+            if (tree) tree->releaseSnapshot(epoch);
+            tree = nullptr;
+        }
+
+        Value search(Key recordId)
+        {
+            ReadingSnapshot reading(tree, epoch);
+            return tree->search(recordId);
+        }
+
+        vector<Value> searchMany(const vector<Key>& keys)
+        {
+            ReadingSnapshot reading(tree, epoch);
+            return tree->searchMany(keys, 1);
+        }
+
+        Iterator lowerBound(Key recordId)
+        {
+            ReadingSnapshot reading(tree, epoch);
+            return tree->lowerBound(recordId);
+        }
+
+        Iterator upperBound(Key recordId)
+        {
+            ReadingSnapshot reading(tree, epoch);
+            return tree->upperBound(recordId);
+        }
+
+        ScanRange scan(Key lo, Key hi)
+        {
+            return ScanRange(lowerBound(lo), hi);
+        }
+
+        // Prints the records of the b-tree file as they were, holding the b-tree latch
+        // shared, so only writers that restructure the b-tree wait for it.
+        void display()
+        {
+            LatchGuard shared(tree->treeLatch.get(), false);
+            ReadingSnapshot reading(tree, epoch);
+            tree->printRecords(numberOfRecords);
+        }
+
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+    };
+
+    // Takes a snapshot of the b-tree between operations.
+    // Until it is released, the first write of every record keeps the earlier image
+    // in memory, so the memory used grows with the records written during the snapshot.
+    Snapshot snapshot()
+    {
+        LatchGuard exclusive(treeLatch.get(), true);
+        unique_lock<shared_mutex> lock(snapshotLatch);
+        liveSnapshots.insert(++latestSnapshot);
+        snapshotting.store(true, memory_order_release);
+        return Snapshot(this, latestSnapshot, numberOfRecords);
+    }
+
+    using Frozen = BasicFrozenBTree<Key, Value>;
+
+    // Returns an immutable in-memory image of the pairs of the b-tree, for periods
+    // without writes, whose searches decode no records. It is read through a snapshot,
+    // so writers carry on while it is made, and does not see their changes.
+    Frozen freeze()
+    {
+        Snapshot frozen = snapshot();
+        vector<Pair> pairs;
+        for (const Pair& p: frozen.scan(numeric_limits<Key>::min(), numeric_limits<Key>::max())) pairs.push_back(p);
+        return Frozen(pairs);
+    }
+
+    // Replaces the contents of the b-tree with the pairs of the given image, with bulkLoad().
+    // Returns false, leaving the b-tree untouched, if there are not enough records.
+    bool thaw(const Frozen& image, double fillFactor = 1.0)
+    {
+        return bulkLoad(image.begin(), image.end(), fillFactor);
+    }
+
+    // Descends to the leaf that holds the first key not less than (inclusive)
+    // or greater than (exclusive) the given recordId, and returns an iterator at it.
+    Iterator seek(Key recordId, bool inclusive)
+    {
+        Iterator it;
+        it.tree = this;
+        it.snapshot = readingSnapshot.first == this ? readingSnapshot.second : 0;
+        LatchGuard shared(treeLatch.get(), false);
+
+        // The first key greater than recordId is the first key not less than recordId + 1
+        bool pastEnd = !inclusive && recordId == numeric_limits<Key>::max();
+        Key bound = inclusive || pastEnd ? recordId : recordId + 1;
+
+        Key keys[Order > 0 ? Order : m];
+        Value references[Order > 0 ? Order : m];
+        Scratch<int> ahead;
+        int i = 1;
+        latchRecord(i, false);
+        while (true)
+        {
+            int status;
+            int count = decodeRecord(i, status, keys, references);
+            if (status != 1)
+            {
+                if (status == 0) it.pairs = node(i);
+                unlatchRecord(i, false);
+                if (status == -1) return it;
+                dropTombstones(it.pairs);
+                break;
+            }
+
+            int child = pastEnd ? count : keyLowerBound(keys, count, bound);
+            if (child == count) --child;
+            if (!hasLeafLinks()) it.path.emplace_back(i, child);
+            leavesAfter(*ahead, references, child, count);
+            latchRecord((int) references[child], false);
+            unlatchRecord(i, false);
+            i = (int) references[child];
+        }
+
+        it.leaf = i;
+        it.prefetched = prefetchRecords(*ahead);
+        auto position = inclusive
+            ? lower_bound(it.pairs.begin(), it.pairs.end(), Pair{recordId, numeric_limits<Value>::min()})
+            : upper_bound(it.pairs.begin(), it.pairs.end(), Pair{recordId, numeric_limits<Value>::max()});
+        it.index = (int) (position - it.pairs.begin());
+
+        // The key may be in the next leaf
+        if (it.index == (int) it.pairs.size() && it.moveLeaf(true)) it.index = 0;
+        return it;
+    }
+
+    // Moves the given path from the root to the leaf after or before its leaf.
+    // Returns the number of that leaf, or -1 if there is none.
+    int siblingLeaf(vector<Path>& path, bool forward)
+    {
+        // Go up to the first ancestor with a child on that side
+        while (!path.empty())
+        {
+            vector<Pair> parent = node(path.back().first);
+            int child = path.back().second + (forward ? 1 : -1);
+            if (child < 0 || child >= (int) parent.size())
+            {
+                path.pop_back();
+                continue;
+            }
+
+            // Then go down its nearest leaf
+            path.back().second = child;
+            int i = (int) parent[child].second;
+            while (!isLeaf(i))
+            {
+                vector<Pair> current = node(i);
+                int nearest = forward ? 0 : (int) current.size() - 1;
+                path.emplace_back(i, nearest);
+                i = (int) current[nearest].second;
+            }
+            return i;
+        }
+        return -1;
+    }
+
+    // Starts reading the leaves after the one that holds the given recordId in the background,
+    // as many as prefetchLeaves under the same parent. Returns the number of leaves.
+    int prefetchLeavesAfter(Key recordId)
+    {
+        Key keys[Order > 0 ? Order : m];
+        Value references[Order > 0 ? Order : m];
+        Scratch<int> ahead;
+        int i = 1;
+        latchRecord(i, false);
+        while (true)
+        {
+            int status;
+            int count = decodeRecord(i, status, keys, references);
+            if (status != 1) break;
+
+            int child = keyLowerBound(keys, count, recordId);
+            if (child == count) --child;
+            leavesAfter(*ahead, references, child, count);
+            latchRecord((int) references[child], false);
+            unlatchRecord(i, false);
+            i = (int) references[child];
+        }
+        unlatchRecord(i, false);
+        return prefetchRecords(*ahead);
+    }
+
+    // Replaces the contents of the b-tree with the given (recordId, reference) pairs,
+    // building it bottom-up so that every record is written exactly once.
+    // The input does not have to be sorted; inputs larger than sortRunPairs
+    // are sorted externally in temporary run files next to the b-tree file.
+    // fillFactor is the fraction of the m pairs that each node is packed with.
+    // Returns false, leaving the b-tree untouched, if there are not enough records.
+    template <class InputIterator>
+    bool bulkLoad(InputIterator first, InputIterator last, double fillFactor = 1.0)
+    {
+        // Read the input in sorted runs, spilling them to disk when it does not fit
+        vector<Pair> run;
+        vector<string> runPaths;
+        long long count = 0;
+        for (; first != last; ++first)
+        {
+            run.emplace_back(first->first, first->second);
+            ++count;
+            if ((int) run.size() == sortRunPairs)
+            {
+                runPaths.push_back(spillRun(run, (int) runPaths.size()));
+                run.clear();
+            }
+        }
+        if (!is_sorted(run.begin(), run.end())) sort(run.begin(), run.end());
+        if (!runPaths.empty() && !run.empty())
+        {
+            runPaths.push_back(spillRun(run, (int) runPaths.size()));
+            run.clear();
+        }
+
+        // Every node but the last of a level holds capacity pairs
+        int capacity = max(max(order() / 2, 1), min(order(), (int) (order() * fillFactor + 0.5)));
+
+        // Count the records of every level, and make sure they are available
+        long long needed = 0;
+        for (long long nodes = count; nodes > 1 || needed == 0;)
+        {
+            nodes = (nodes + capacity - 1) / capacity;
+            needed += nodes;
+            if (count == 0) break;
+        }
+        LatchGuard exclusive(treeLatch.get(), true);
+        if (needed > numberOfRecords - 1)
+        {
+            if (growthRecords == 0)
+            {
+                for (const string& runPath: runPaths) std::remove(runPath.c_str());
+                return false;
+            }
+
+            // Grow the file by whole extents before initializing it
+            long long extents = (needed - (numberOfRecords - 1) + growthRecords - 1) / growthRecords;
+            setNumberOfRecords((int) (numberOfRecords + extents * growthRecords));
+        }
+
+        beginBulkLoad();
+        initialize();
+        if (count == 0)
+        {
+            endBulkLoad();
+            return true;
+        }
+
+        // Record 1 is kept for the root, the rest are allocated in order
+        vector<BulkLevel> levels(1);
+        int nextRecord = 2;
+
+        if (runPaths.empty())
+        {
+            for (const auto& p: run) bulkAppend(levels, 0, p, capacity, nextRecord);
+        }
+        else
+        {
+            // Merge the sorted runs
+            vector<ifstream> runs;
+            using Head = pair<Pair, int>;
+            priority_queue<Head, vector<Head>, greater<Head>> heads;
+            for (const string& runPath: runPaths)
+            {
+                runs.emplace_back(runPath, ios::binary);
+                Pair p;
+                if (readRunPair(runs.back(), p)) heads.emplace(p, (int) runs.size() - 1);
+            }
+            while (!heads.empty())
+            {
+                Head head = heads.top();
+                heads.pop();
+                bulkAppend(levels, 0, head.first, capacity, nextRecord);
+
+                Pair p;
+                if (readRunPair(runs[head.second], p)) heads.emplace(p, head.second);
+            }
+            runs.clear();
+            for (const string& runPath: runPaths) std::remove(runPath.c_str());
+        }
+
+        bulkFinish(levels, capacity, nextRecord);
+
+        // The rest of the records stay in the available list
+        writeCell(nextRecord < numberOfRecords ? nextRecord : -1, 0, 1);
+        endBulkLoad();
+        return true;
+    }
+
+    // The nodes of one level of the b-tree while it is being bulk loaded.
+    struct BulkLevel {
+        // The node being filled.
+        vector<Pair> pending;
+
+        // The last full node, held back so that it can share
+        // its pairs with an underfull last node.
+        vector<Pair> held;
+
+        // The record chosen for the held node, or -1 if not chosen yet.
+        int heldRecord = -1;
+
+        // The record of the last node of this level written so far.
+        int lastRecord = -1;
+
+        // The number of nodes of this level written so far.
+        int written = 0;
+    };
+
+    // Adds a pair to the given level of a bulk load,
+    // writing the held node when another one fills up.
+    void bulkAppend(vector<BulkLevel>& levels, int level, const Pair& p, int capacity, int& nextRecord)
+    {
+        levels[level].pending.push_back(p);
+        if ((int) levels[level].pending.size() < capacity) return;
+
+        vector<Pair> full = move(levels[level].pending);
+        levels[level].pending.clear();
+        levels[level].held.swap(full);
+        int fullRecord = levels[level].heldRecord;
+        levels[level].heldRecord = -1;
+        if (full.empty()) return;
+
+        // The written node links to the new held node, so choose its record now
+        if (fullRecord == -1) fullRecord = nextRecord++;
+        int next = levels[level].heldRecord = nextRecord++;
+        bulkWrite(levels, level, full, fullRecord, next, capacity, nextRecord);
+    }
+
+    // Writes a node of the given level in the specified record,
+    // and adds its maximum to the level above.
+    // next is the record of the following node of the same level.
+    void bulkWrite(vector<BulkLevel>& levels, int level, const vector<Pair>& node,
+                   int recordNumber, int next, int capacity, int& nextRecord)
+    {
+        // Only the leaves are linked
+        if (level == 0) writeWholeNode(0, node, recordNumber, levels[level].lastRecord, next);
+        else writeWholeNode(1, node, recordNumber);
+        levels[level].lastRecord = recordNumber;
+        ++levels[level].written;
+
+        if (level + 1 == (int) levels.size()) levels.emplace_back();
+        bulkAppend(levels, level + 1, {node.back().first, recordNumber}, capacity, nextRecord);
+    }
+
+    // Writes the remaining nodes of every level, and the root in record 1.
+    void bulkFinish(vector<BulkLevel>& levels, int capacity, int& nextRecord)
+    {
+        for (int level = 0; level < (int) levels.size(); ++level)
+        {
+            BulkLevel& current = levels[level];
+
+            // Give an underfull last node pairs from the held node,
+            // or merge them if they fit in one node
+            if (!current.held.empty() && !current.pending.empty() && (int) current.pending.size() < order() / 2)
+            {
+                current.held.insert(current.held.end(), current.pending.begin(), current.pending.end());
+                current.pending.clear();
+                if ((int) current.held.size() > order())
+                {
+                    auto middle = current.held.begin() + current.held.size() / 2;
+                    current.pending.assign(middle, current.held.end());
+                    current.held.erase(middle, current.held.end());
+                }
+            }
+
+            // The only node of the top level is the root
+            int remaining = !current.held.empty() + !current.pending.empty();
+            if (current.written == 0 && remaining == 1)
+            {
+                writeWholeNode(level == 0 ? 0 : 1, current.held.empty() ? current.pending : current.held, 1);
+                return;
+            }
+
+            // bulkWrite() appends to the next level, so take the nodes out first
+            vector<Pair> held = move(current.held), pending = move(current.pending);
+            int heldRecord = current.heldRecord;
+            if (!held.empty() && heldRecord == -1) heldRecord = nextRecord++;
+            int pendingRecord = pending.empty() ? -1 : nextRecord++;
+
+            if (!held.empty()) bulkWrite(levels, level, held, heldRecord, pendingRecord, capacity, nextRecord);
+            if (!pending.empty()) bulkWrite(levels, level, pending, pendingRecord, -1, capacity, nextRecord);
+        }
+    }
+
+    // Writes the leaf status, the pairs and the leaf links of a node
+    // in the specified record at once.
+    void writeWholeNode(int leafStatus, NodeView node, int recordNumber,
+                        int previous = -1, int next = -1)
+    {
+        countNode(&BTreeCounters::OperationCounters::nodeWrites);
+        char record[recordSize()];
+        encodeCell(leafStatus, record);
+        for (int i = 0; i < 2 * order(); ++i) encodeCell(-1, record + (i + 1) * cellSize);
+        for (int i = 0; i < (int) node.size() && i < order(); ++i)
+        {
+            encodeCell(node[i].first, record + (2 * i + 1) * cellSize);
+            encodeCell(node[i].second, record + (2 * i + 2) * cellSize);
+        }
+        if (hasLeafLinks())
+        {
+            encodeCell(next, record + nextLeafCell() * cellSize);
+            encodeCell(previous, record + previousLeafCell() * cellSize);
+        }
+        writeBytes(recordNumber, 0, record, recordSize());
+        if (filters && leafStatus == 0) buildFilter(recordNumber, node);
+    }
+
+    // Sorts the given pairs and writes them to a temporary run file.
+    // Returns the path of the run file.
+    string spillRun(vector<Pair>& run, int runNumber)
+    {
+        sort(run.begin(), run.end());
+        string runPath = path + ".run" + to_string(runNumber);
+        ofstream out(runPath, ios::binary | ios::trunc);
+        for (const auto& p: run)
+        {
+            out.write((const char*) &p.first, sizeof p.first);
+            out.write((const char*) &p.second, sizeof p.second);
+        }
+        return runPath;
+    }
+
+    // Reads the next pair of a run file.
+    // Returns false at the end of the run.
+    static bool readRunPair(ifstream& in, Pair& p)
+    {
+        return in.read((char*) &p.first, sizeof p.first) && in.read((char*) &p.second, sizeof p.second);
+    }
+
+    // Compacts the b-tree online, in steps that each hold the b-tree exclusively
+    // for about as long as a split does, so other operations run between them:
+    //  - if removals leave tombstones, they are purged from the leaves, one leaf per step;
+    //  - the children of every internal node are repacked into as few nodes as fillFactor
+    //    allows, from the parents of the leaves up to the root, freeing the rest;
+    //  - the records that hold nodes are counted, and the available list is rebuilt in order
+    //    without the empty records among as many first ones, a bounded run of records per step;
+    //  - the nodes are moved into breadth-first order after the root, one node per step,
+    //    trading places with the node in the way if there is one;
+    //  - the b-tree file is truncated after the last node unless it is a text file that grows,
+    //    and the available list is rebuilt in order again, a bounded run of records per step.
+    // The steps that start a pass over the records also write back the buffer pool and the log.
+    // Runs at most the given number of steps, or the rest of the compaction if steps is 0.
+    // Returns true once the compaction has finished; the next call starts another.
+    // Nodes that splits add meanwhile are moved only if they come later in breadth-first order.
+    // Like merges, the steps invalidate the iterators over the b-tree.
+    bool compact(int steps = 0, double fillFactor = 1.0)
+    {
+        for (int step = 0; steps <= 0 || step < steps; ++step)
+        {
+            Operation operation(*this);
+            LatchGuard exclusive(treeLatch.get(), true);
+            if (operation.end(compactStep(fillFactor))) return true;
+        }
+        return false;
+    }
+
+    // Runs one step of the compaction. The caller holds the b-tree exclusively.
+    // Returns true if the compaction finished.
+    bool compactStep(double fillFactor)
+    {
+        Compaction& c = compaction;
+        if (c.phase == Compaction::Idle)
+        {
+            // An empty b-tree keeps even its root in the available list
+            if (isEmpty(1)) return true;
+            c = Compaction();
+            c.phase = tombstoneRatio > 0 ? Compaction::Purge : Compaction::Repack;
+            c.capacity = max(max(order() / 2, 1), min(order(), (int) (order() * fillFactor + 0.5)));
+            return false;
+        }
+
+        // Purge the tombstones of one leaf per step, in key order
+        if (c.phase == Compaction::Purge)
+        {
+            // A root without pairs leaves no leaf to purge
+            int parent = -1;
+            Key maximum{};
+            int levels = height();
+            int recordNumber = levels == 0 ? -1 : nodeAfter(levels - 1, c, parent, maximum);
+            if (recordNumber == -1)
+            {
+                c.phase = Compaction::Repack;
+                c.started = false;
+                return false;
+            }
+            vector<Pair> leaf = node(recordNumber);
+            if (any_of(leaf.begin(), leaf.end(), [this](const Pair& p) { return isTombstone(p.second); })) purgeLeaf(maximum);
+            c.last = maximum;
+            c.started = true;
+            return false;
+        }
+
+        if (c.phase == Compaction::Repack)
+        {
+            int depth = height() - 2 - c.level;
+            int parent = -1;
+            Key maximum{};
+            int recordNumber = depth < 0 ? -1 : nodeAfter(depth, c, parent, maximum);
+            if (recordNumber == -1 && depth > 0)
+            {
+                ++c.level;
+                c.started = false;
+                return false;
+            }
+            if (recordNumber == -1)
+            {
+                collapseRoot();
+                c.phase = Compaction::Count;
+                return false;
+            }
+            repackChildren(recordNumber, c.capacity);
+            c.last = maximum;
+            c.started = true;
+            return false;
+        }
+
+        // Count the records that hold nodes, which the nodes fill once they are moved
+        if (c.phase == Compaction::Count)
+        {
+            if (c.cursor == 0)
+            {
+                flushWrittenRecords();
+                c.cursor = 1;
+            }
+            int end = max(min((int) writtenRecords, numberOfRecords), 2);
+            for (int visited = 0; visited < Compaction::recordsPerStep && c.cursor < end; ++visited, ++c.cursor)
+                if (!isEmpty(c.cursor)) ++c.nodes;
+            if (c.cursor < end) return false;
+            c.phase = Compaction::Prepare;
+            c.cursor = 0;
+            return false;
+        }
+
+        // Rebuild the available list in order, but for the empty records among the first ones,
+        // which are kept out of it for the nodes to move into
+        if (c.phase == Compaction::Prepare)
+        {
+            if (!c.linking) beginLinking();
+            if (!linkEmptyRecords(Compaction::recordsPerStep)) return false;
+            c.linking = false;
+            c.freed.clear();
+            c.phase = Compaction::Relocate;
+            c.level = 1;
+            c.started = false;
+            return false;
+        }
+
+        if (c.phase == Compaction::Relocate)
+        {
+            int parent = -1;
+            Key maximum{};
+            int recordNumber = nodeAfter(c.level, c, parent, maximum);
+            if (recordNumber == -1)
+            {
+                if (c.level + 1 >= height()) c.phase = Compaction::Trim;
+                ++c.level;
+                c.started = false;
+                return false;
+            }
+            c.last = maximum;
+            c.started = true;
+
+            int position = c.position++;
+            if (recordNumber == position || position >= numberOfRecords) return false;
+            bool hole = c.holes.erase(position);
+            if (hole || isEmpty(position))
+            {
+                // An empty record that was freed meanwhile is near the head of the available list
+                if (!hole) takeEmpty(position);
+                exchangeNodes(recordNumber, position, parent, -1);
+                c.holes.insert(recordNumber);
+                return false;
+            }
+
+            int otherParent = parentOf(position);
+            if (otherParent != -1) exchangeNodes(recordNumber, position, parent, otherParent);
+            return false;
+        }
+
+        // Find the end of the file left without nodes, from the last record down.
+        // A text file keeps its length, which is where it records a number of records
+        // that has grown, unless the number of records is given whenever it is opened.
+        if (c.phase == Compaction::Trim)
+        {
+            if (c.cursor == 0)
+            {
+                flushWrittenRecords();
+                c.cursor = max(min((int) writtenRecords, numberOfRecords), 2) - 1;
+                c.kept = format == CellFormat::Binary || growthRecords == 0 ? 2 : c.cursor + 1;
+                c.allocated = 0;
+            }
+            for (int visited = 0; visited < Compaction::recordsPerStep && c.kept == 2 && c.cursor >= 2; ++visited, --c.cursor)
+                if (!isEmpty(c.cursor)) c.kept = c.cursor + 1;
+            if (c.kept == 2 && c.cursor >= 2) return false;
+
+            // Truncate the file there, so that the records after it read as unwritten records,
+            // which link to the next one in the available list. Records allocated meanwhile stay.
+            c.kept = max(c.kept, c.allocated + 1);
+            flushWrittenRecords();
+            if (c.kept < writtenRecords && (format == CellFormat::Binary || growthRecords == 0)) truncateRecords(c.kept);
+            c.phase = Compaction::Finish;
+            c.holes.clear();
+            c.nodes = 0;
+            c.cursor = 0;
+            return false;
+        }
+
+        // Rebuild the available list in order, holes included
+        if (!c.linking) beginLinking();
+        if (!linkEmptyRecords(Compaction::recordsPerStep)) return false;
+        c = Compaction();
+        return true;
+    }
+
+    // Starts a pass that puts the empty records back in the available list from the last
+    // written record down: the list is left with the unwritten records at the end of the file,
+    // and the records freed meanwhile go in front of them as usual.
+    void beginLinking()
+    {
+        Compaction& c = compaction;
+        flushWrittenRecords();
+        int end = max(min((int) writtenRecords, numberOfRecords), 2);
+        writeCell(end < numberOfRecords ? end : -1, 0, 1);
+        c.cursor = end - 1;
+        c.linking = true;
+        c.freed.clear();
+    }
+
+    // Visits at most count records from the cursor of the compaction down to the root,
+    // putting the empty ones at the head of the available list, so that it runs in order,
+    // unless they were freed since the pass began or are among the records the nodes fill.
+    // Returns true once the pass has visited the root.
+    bool linkEmptyRecords(int count)
+    {
+        Compaction& c = compaction;
+        for (; count > 0 && c.cursor >= 1; --count, --c.cursor)
+        {
+            int i = c.cursor;
+            if (c.freed.count(i) || !isEmpty(i)) continue;
+            if (i > 1 && i <= c.nodes) c.holes.insert(i);
+            else
+            {
+                writeCell(nextEmpty(), i, 1);
+                writeCell(i, 0, 1);
+            }
+        }
+        return c.cursor < 1;
+    }
+
+    // Applies the logged writes and writes the records cached in the buffer pool to the b-tree file,
+    // so that the records from writtenRecords on are the unwritten ones.
+    void flushWrittenRecords()
+    {
+        commitLog(true);
+        if (pool) pool->flush();
+    }
+
+    // Returns the first node at the given depth below the root whose maximum key is greater than
+    // the last one the compaction visited there, or -1 if there is none. Sets parent to the node
+    // that holds its entry, and maximum to the maximum key in the entry.
+    int nodeAfter(int depth, const Compaction& c, int& parent, Key& maximum)
+    {
+        if (depth < 0) return -1;
+        if (depth == 0) return c.started ? -1 : 1;
+        int recordNumber = 1;
+        for (int level = 0; level < depth; ++level)
+        {
+            if (isLeaf(recordNumber)) return -1;
+            vector<Pair> entries = node(recordNumber);
+            auto entry = entries.begin();
+            if (c.started)
+                entry = find_if(entries.begin(), entries.end(), [&](const Pair& p) { return c.last < p.first; });
+            if (entry == entries.end()) return -1;
+            parent = recordNumber;
+            maximum = entry->first;
+            recordNumber = (int) entry->second;
+        }
+        return recordNumber;
+    }
+
+    // Spreads the pairs of the children of the given internal node over as few of them
+    // as hold capacity pairs each, or half of m at least, and frees the others.
+    // A parent left underfull is repacked along with its siblings at the level above.
+    void repackChildren(int recordNumber, int capacity)
+    {
+        vector<Pair> entries = node(recordNumber), pairs;
+        for (const auto& entry: entries)
+        {
+            vector<Pair> child = node((int) entry.second);
+            pairs.insert(pairs.end(), child.begin(), child.end());
+        }
+
+        int total = (int) pairs.size(), minimum = max(order() / 2, 1);
+        int nodes = min((total + capacity - 1) / capacity, max(1, total / minimum));
+        if (nodes >= (int) entries.size()) return;
+
+        // The kept children stay linked in order; the freed ones are unlinked
+        vector<Pair> kept;
+        int first = 0;
+        for (int i = 0; i < nodes; ++i)
+        {
+            int size = total / nodes + (i < total % nodes);
+            int child = (int) entries[i].second;
+            writeNode(NodeView(pairs.data() + first, size), child);
+            first += size;
+            kept.emplace_back(pairs[first - 1].first, child);
+        }
+        for (int i = nodes; i < (int) entries.size(); ++i)
+        {
+            int child = (int) entries[i].second;
+            if (hasLeafLinks() && isLeaf(child)) linkLeaves(previousLeaf(child), nextLeaf(child));
+            freeRecord(child);
+            count(&BTreeCounters::merges);
+        }
+        writeNode(kept, recordNumber);
+    }
+
+    // Replaces a root with a single child by that child, for as many levels as there are.
+    void collapseRoot()
+    {
+        while (!isLeaf(1))
+        {
+            vector<Pair> entries = node(1);
+            if (entries.size() != 1) return;
+            int child = (int) entries[0].second;
+            writeWholeNode(leafStatus(child), node(child), 1);
+            freeRecord(child);
+            count(&BTreeCounters::merges);
+        }
+    }
+
+    // Returns the parent of the node in the given record, found from its last key,
+    // or -1 if no descent reaches it.
+    int parentOf(int recordNumber)
+    {
+        vector<Pair> pairs = node(recordNumber);
+        if (pairs.empty()) return -1;
+        for (int i = 1; !isLeaf(i);)
+        {
+            int child = childFor(i, pairs.back().first);
+            if (child == recordNumber) return i;
+            i = child;
+        }
+        return -1;
+    }
+
+    // Takes the given empty record out of the available list, if it is in it.
+    void takeEmpty(int recordNumber)
+    {
+        // The unwritten records at the end of the list are in order
+        for (int previous = 0, i = nextEmpty(); i != -1; previous = i, i = cell(i, 1))
+        {
+            if (i == recordNumber)
+            {
+                writeCell(cell(i, 1), previous, 1);
+                return;
+            }
+            if (i >= writtenRecords && i > recordNumber) return;
+        }
+    }
+
+    // Trades the records of two nodes, given their parents, updating the entries
+    // in the parents and the links of the neighbouring leaves. A parent of -1
+    // marks an empty record out of the available list, which is left cleared.
+    void exchangeNodes(int a, int b, int parentA, int parentB)
+    {
+        auto other = [&](int i) { return i == a ? b : i == b ? a : i; };
+        char recordA[recordSize()], recordB[recordSize()];
+        readBytes(a, 0, recordA, recordSize());
+        readBytes(b, 0, recordB, recordSize());
+        int linksA[2] = {-1, -1}, linksB[2] = {-1, -1};
+        if (hasLeafLinks() && leafStatus(a) == 0) linksA[0] = previousLeaf(a), linksA[1] = nextLeaf(a);
+        if (hasLeafLinks() && leafStatus(b) == 0) linksB[0] = previousLeaf(b), linksB[1] = nextLeaf(b);
+        writeBytes(b, 0, recordA, recordSize());
+        writeBytes(a, 0, recordB, recordSize());
+
+        // A parent may be one of the traded nodes; each holds the entry of either at most once
+        int parents[2] = {other(parentA), parentB == -1 ? -1 : other(parentB)};
+        if (parents[1] == parents[0]) parents[1] = -1;
+        for (int parent: parents)
+        {
+            if (parent == -1) continue;
+            vector<Pair> entries = node(parent);
+            for (auto& entry: entries) entry.second = other((int) entry.second);
+            writeNode(entries, parent);
+        }
+
+        // The leaves linked to either, including the traded leaves themselves
+        if (hasLeafLinks())
+        {
+            set<int> leaves{a, b};
+            for (int link: {linksA[0], linksA[1], linksB[0], linksB[1]})
+                if (link != -1) leaves.insert(other(link));
+            for (int leaf: leaves)
+            {
+                if (leafStatus(leaf) != 0) continue;
+                int previous = previousLeaf(leaf), next = nextLeaf(leaf);
+                if (other(previous) != previous) writeCell(other(previous), leaf, previousLeafCell());
+                if (other(next) != next) writeCell(other(next), leaf, nextLeafCell());
+            }
+        }
+
+        if (parentB == -1)
+        {
+            clearRecord(a);
+            unlinkLeaf(a);
+            markEmpty(a);
+        }
+        else if (filters && leafStatus(a) == 0) buildFilter(a, node(a));
+        if (filters && leafStatus(b) == 0) buildFilter(b, node(b));
+    }
+
+    // Drops the records from the given one on from the b-tree file, which then read
+    // as unwritten records. The caller holds the b-tree exclusively and has applied the log.
+    void truncateRecords(int count)
+    {
+        if (snapshotting.load(memory_order_acquire)) preserveRecords(count, writtenRecords);
+        if (pool)
+        {
+            pool->flush();
+            pool->discard();
+        }
+        file->resize((long long) count * recordSize());
+        writtenRecords = count;
+
+        // The log that follows is replayed on the truncated file
+        if (log) file->sync();
+    }
+
+    // Returns the empty records a compaction cut short kept out of the available list.
+    void releaseHoles()
+    {
+        if (compaction.holes.empty() && !compaction.linking) return;
+        Operation operation(*this);
+        for (int hole: compaction.holes)
+        {
+            writeCell(nextEmpty(), hole, 1);
+            writeCell(hole, 0, 1);
+        }
+
+        // A pass that was putting the empty records back in the list finishes without holes
+        compaction.holes.clear();
+        compaction.nodes = 0;
+        if (compaction.linking) linkEmptyRecords(numeric_limits<int>::max());
+        compaction = Compaction();
+        operation.end();
+    }
+
+    // Reads and returns the cell at the specified record and pair numbers.
+    Pair _pair(int recordNumber, int pairNumber)
+    {
+        // Validate inputs
+        validateRecordNumber(recordNumber);
+        validatePairNumber(pairNumber);
+
+        // Create and return the cell
+        Pair thePair;
+        thePair.first = (Key) cellValue(recordNumber, 2 * pairNumber - 1);
+        thePair.second = (Value) cellValue(recordNumber, 2 * pairNumber);
+        return thePair;
+    }
+
+    // Reads the specified record once and decodes its leaf status,
+    // and the keys and the references of its pairs into separate arrays of m values.
+    // Returns the number of pairs.
+    int decodeRecord(int recordNumber, int& status, Key* keys, Value* references)
+    {
+        validateRecordNumber(recordNumber);
+        countNode(&BTreeCounters::OperationCounters::nodeReads);
+
+        char record[recordSize()];
+        readBytes(recordNumber, 0, record, recordSize());
+
+        status = (int) decodeCell(record);
+        int count = 0;
+        for (; count < order(); ++count)
+        {
+            Value reference = (Value) decodeCell(record + (2 * count + 2) * cellSize);
+
+            // If it is empty then the rest is empty
+            if (reference == -1) break;
+
+            keys[count] = (Key) decodeCell(record + (2 * count + 1) * cellSize);
+            references[count] = reference;
+        }
+        return count;
+    }
+
+    // Returns the child of the internal record to descend into for the given recordId:
+    // the first child whose maximum is not less than recordId, or the last child.
+    int childFor(int recordNumber, Key recordId)
+    {
+        Key keys[Order > 0 ? Order : m];
+        Value references[Order > 0 ? Order : m];
+        int status;
+        int count = decodeRecord(recordNumber, status, keys, references);
+        int index = keyLowerBound(keys, count, recordId);
+        return (int) references[index < count ? index : count - 1];
+    }
+
+    // Takes the latch of the given record, shared or exclusive,
+    // if the b-tree is thread-safe. Latches are taken from the root down.
+    // Reads through a snapshot take none: what they read does not change,
+    // and a record may be above another in a snapshot and below it now.
+    void latchRecord(int recordNumber, bool exclusive)
+    {
+        if (!recordLatches || readingSnapshot.first == this) return;
+        validateRecordNumber(recordNumber);
+        if (exclusive) recordLatches[recordNumber].lock();
+        else recordLatches[recordNumber].lock_shared();
+    }
+
+    // Releases the latch taken by latchRecord().
+    void unlatchRecord(int recordNumber, bool exclusive)
+    {
+        if (!recordLatches || readingSnapshot.first == this) return;
+        if (exclusive) recordLatches[recordNumber].unlock();
+        else recordLatches[recordNumber].unlock_shared();
+    }
+
+    // Reads the node at the specified record number under its shared latch.
+    vector<Pair> leafNode(int recordNumber)
+    {
+        latchRecord(recordNumber, false);
+        vector<Pair> theNode = node(recordNumber);
+        unlatchRecord(recordNumber, false);
+        return theNode;
+    }
+
+    // Descends to the leaf of the given recordId, latching each child before
+    // releasing its parent, and latches the leaf exclusively.
+    // Returns the leaf, or -1 if the b-tree is empty or recordId is greater than
+    // every key of the b-tree (when rightmost is false), leaving nothing latched.
+    // The caller holds the b-tree latch shared, so no node changes its level.
+    int latchLeaf(Key recordId, bool rightmost)
+    {
+        Key keys[Order > 0 ? Order : m];
+        Value references[Order > 0 ? Order : m];
+        int i = 1;
+        latchRecord(i, false);
+        while (true)
+        {
+            int status;
+            int count = decodeRecord(i, status, keys, references);
+            if (status != 1)
+            {
+                unlatchRecord(i, false);
+                if (status == -1) return -1;
+
+                // Only writers of this leaf wait here, and they release it without waiting
+                latchRecord(i, true);
+                return i;
+            }
+
+            int index = keyLowerBound(keys, count, recordId);
+            if (index == count && !rightmost)
+            {
+                unlatchRecord(i, false);
+                return -1;
+            }
+
+            int child = (int) references[index < count ? index : count - 1];
+            latchRecord(child, false);
+            unlatchRecord(i, false);
+            i = child;
+        }
+    }
+
+    // Inserts the pair if its leaf has room and its maximum does not change,
+    // so that no other record is modified. Holds only the latch of the leaf.
+    // Returns the leaf, or -1 if the insertion has to restructure the b-tree.
+    int insertInLeaf(Key recordId, Value reference)
+    {
+        int i = latchLeaf(recordId, false);
+        if (i == -1) return -1;
+
+        Scratch<Pair> current;
+        node(i, *current);
+        if (reviveTombstone(*current, recordId, reference))
+        {
+            writeNode(*current, i);
+            unlatchRecord(i, true);
+            return i;
+        }
+
+        bool fits = (int) current->size() < order() && (i == 1 || (!current->empty() && recordId <= current->back().first));
+        if (fits)
+        {
+            Pair p{recordId, reference};
+            current->insert(upper_bound(current->begin(), current->end(), p), p);
+            writeNode(*current, i);
+        }
+
+        unlatchRecord(i, true);
+        return fits ? i : -1;
+    }
+
+    // Removes the value if its leaf keeps at least m / 2 pairs and its maximum,
+    // or leaves a tombstone if the leaf stays within tombstoneRatio,
+    // so that no other record is modified. Holds only the latch of the leaf.
+    // Returns false if the removal has to restructure the b-tree.
+    bool removeInLeaf(Key recordId)
+    {
+        int i = latchLeaf(recordId, true);
+        if (i == -1) return true;
+
+        Scratch<Pair> current;
+        node(i, *current);
+        auto position = livePair(*current, recordId);
+        bool found = position != current->end();
+        bool done;
+        if (tombstoneRatio > 0)
+        {
+            // A leaf whose tombstones pass the ratio is purged with the b-tree latched exclusively
+            if (found) position->second = tombstone;
+            done = !found || !overTombstoneRatio(*current);
+            if (done && found) writeNode(*current, i);
+        }
+        else
+        {
+            done = (int) current->size() - found >= order() / 2 && (!found || position + 1 != current->end());
+            if (done && found)
+            {
+                current->erase(position);
+                writeNode(*current, i);
+            }
+        }
+
+        unlatchRecord(i, true);
+        return done;
+    }
+
+    // Reads and returns the node at the specified record number.
+    vector<Pair> node(int recordNumber)
+    {
+        vector<Pair> theNode;
+        node(recordNumber, theNode);
+        return theNode;
+    }
+
+    // Reads the node at the specified record number into the given vector.
+    // The vector keeps room for one more pair, so a scratch vector
+    // holds the node and a pair inserted into it without allocating again.
+    void node(int recordNumber, vector<Pair>& theNode)
+    {
+          // Validate input
+        validateRecordNumber(recordNumber);
+        countNode(&BTreeCounters::OperationCounters::nodeReads);
+
+        // Read the whole record at once
+        char record[recordSize()];
+        readBytes(recordNumber, 0, record, recordSize());
+
+        theNode.clear();
+        theNode.reserve(order() + 1);
+
+        // Decode every pair in the node
+        for (int i = 1; i <= order(); ++i) {
+            Pair p{(Key) decodeCell(record + (2 * i - 1) * cellSize),
+                   (Value) decodeCell(record + 2 * i * cellSize)};
+
+            // If it is empty then the rest is empty, so return
+            if (p.second == -1) return;
+
+            // Otherwise, continue reading the node
+            theNode.push_back(p);
+        }
+    }
+
+    // Returns the value of the second pair in the header.
+    // This value is the number of the first empty record
+    // available for allocation.
+    int nextEmpty()
+    {
+        return cell(0, 1);
+    }
+
+    // Returns true if the record's leaf status is equal to 0
+    bool isLeaf(int recordNumber)
+    {
+        return cell(recordNumber, 0) == 0;
+    }
+
+    // Returns true if the record's leaf status is equal to -1
+    bool isEmpty(int recordNumber)
+    {
+        return cell(recordNumber, 0) == -1;
+    }
+    // A change to the entry of a child in its parent,
+    // which holds the maximum key of every child.
+    struct SeparatorChange {
+        enum Kind {
+            // The child has a new maximum key.
+            Updated,
+
+            // The child is new, split off another child.
+            Added,
+
+            // The child was emptied or merged into a sibling.
+            Removed
+        };
+
+        int record;
+        Key maximum;
+        Kind kind;
+    };
+
+    // The changes a node makes to the entries of its parent. There are at most two,
+    // since a node only splits in two, or borrows from or merges into one sibling.
+    class SeparatorChanges {
+    private:
+        SeparatorChange changes[2];
+        int count = 0;
+
+    public:
+        SeparatorChanges() = default;
+        SeparatorChanges(initializer_list<SeparatorChange> list)
+        {
+            for (const SeparatorChange& change: list) push_back(change);
+        }
+
+        void push_back(const SeparatorChange& change) { changes[count++] = change; }
+        bool empty() const { return count == 0; }
+        const SeparatorChange* begin() const { return changes; }
+        const SeparatorChange* end() const { return changes + count; }
+    };
+
+    // Splits the record into two.
+    // Returns the changes to the entries of the parent: the new maximum of the record
+    // and the entry of the newly allocated record. The root has no parent,
+    // and a failed split changes nothing, so both return no changes.
+    SeparatorChanges split(int recordNumber, NodeView originalNode)
+    {
+        if (recordNumber == 1)
+        {
+            split(originalNode);
+            return {};
+        }
+
+        // If there are no empty records, then splitting fails
+        if (!ensureEmptyRecords(1)) return {};
+        count(&BTreeCounters::nodeSplits);
+
+        // Get the index of the new record created after split
+        int newRecordNumber = allocateRecord();
+
+        // Distribute originalNode on two new nodes: the lower half and the upper half
+        int middle = originalNode.size() / 2;
+        NodeView firstNode(originalNode.begin(), middle);
+        NodeView secondNode(originalNode.begin() + middle, originalNode.size() - middle);
+
+        // Both halves keep the leaf status of the split record
+        int status = leafStatus(recordNumber);
+
+        // Clear originalNodeIndex and newNodeIndex
+        clearRecord(recordNumber);
+        clearRecord(newRecordNumber);
+
+        markLeaf(recordNumber, status);
+        writeNode(firstNode, recordNumber);
+
+        markLeaf(newRecordNumber, status);
+        writeNode(secondNode, newRecordNumber);
+
+        // The new leaf holds the upper half, so it follows the split leaf
+        if (hasLeafLinks() && status == 0)
+        {
+            int next = nextLeaf(recordNumber);
+            linkLeaves(recordNumber, newRecordNumber);
+            linkLeaves(newRecordNumber, next);
+        }
+
+        return {{recordNumber, firstNode.back().first, SeparatorChange::Updated},
+                {newRecordNumber, secondNode.back().first, SeparatorChange::Added}};
+    }
+
+    // Splits the root into two and allocates a new root.
+    bool split(NodeView root)
+    {
+        // Find 2 empty records for the new nodes
+        if (!ensureEmptyRecords(2)) return false;
+        int firstNodeIndex = nextEmpty();
+
+        // Get next empty node in available list
+        int secondNodeIndex = cell(firstNodeIndex, 1);
+
+        // Update the next empty cell with the next in available list
+        writeCell(cell(secondNodeIndex, 1), 0, 1);
+        count(&BTreeCounters::allocations, 2);
+        count(&BTreeCounters::rootSplits);
+
+        // Fill first and second nodes from root: the lower half and the upper half
+        int middle = root.size() / 2;
+        NodeView firstNode(root.begin(), middle);
+        NodeView secondNode(root.begin() + middle, root.size() - middle);
+
+        markLeaf(firstNodeIndex, leafStatus(1));
+        writeNode(firstNode, firstNodeIndex);
+
+        markLeaf(secondNodeIndex, leafStatus(1));
+        writeNode(secondNode, secondNodeIndex);
+
+        // A leaf root becomes the only two leaves
+        if (hasLeafLinks() && leafStatus(1) == 0)
+        {
+            linkLeaves(-1, firstNodeIndex);
+            linkLeaves(firstNodeIndex, secondNodeIndex);
+            linkLeaves(secondNodeIndex, -1);
+        }
+
+        clearRecord(1);
+
+        // Create new root with max values from the 2 new nodes
+        Pair newRoot[2] = {{firstNode.back().first, firstNodeIndex}, {secondNode.back().first, secondNodeIndex}};
+        markNonLeaf(1);
+        writeNode(NodeView(newRoot, 2), 1);
+
+        return true;
+    }
+
+    // An internal record on the path of insertBatch(),
+    // with the index of the child taken and its number of pairs.
+    struct BatchStep {
+        int record;
+        int child;
+        int count;
+    };
+
+    // Returns the number of nodes that the given number of pairs is spread over.
+    int nodesFor(int size) const
+    {
+        return size <= order() ? 1 : (size + order() - 1) / order();
+    }
+
+    // Returns the number of empty records needed to add the given number of pairs
+    // to the leaf at the end of the given path, counting the splits of its ancestors.
+    int recordsNeeded(const vector<BatchStep>& path, int leafSize) const
+    {
+        int needed = 0;
+        int nodes = nodesFor(leafSize);
+        for (int level = (int) path.size() - 1; level >= 0; --level)
+        {
+            needed += nodes - 1;
+            nodes = nodesFor(path[level].count + nodes - 1);
+        }
+
+        // A split root moves all of its nodes out, and may need another level
+        while (nodes > 1)
+        {
+            needed += nodes;
+            nodes = nodesFor(nodes);
+        }
+        return needed;
+    }
+
+    // Returns true if the available list holds at least the given number of records,
+    // growing the b-tree file by whole extents if it does not and growth is enabled.
+    bool ensureEmptyRecords(int count)
+    {
+        int recordNumber = nextEmpty();
+        for (int i = 0; i < count; ++i)
+        {
+            if (recordNumber == -1)
+            {
+                if (growthRecords == 0) return false;
+                growFile((count - i + growthRecords - 1) / growthRecords * growthRecords);
+                return true;
+            }
+            recordNumber = cell(recordNumber, 1);
+        }
+        return true;
+    }
+
+    // Appends the given number of empty records to the b-tree file
+    // and puts them at the head of the available list.
+    // The numbers of the existing records do not change.
+    void growFile(int count)
+    {
+        // The record after the last one in the available list was never used
+        int first = numberOfRecords;
+        int head = nextEmpty();
+
+        // Unwritten records link to the next one depending on the number of records
+        writeUnwrittenRecords(numberOfRecords);
+        setNumberOfRecords(numberOfRecords + count);
+        file->reserve((long long) (numberOfRecords + 1) * recordSize());
+
+        char record[recordSize()];
+        for (int recordIndex = first; recordIndex <= numberOfRecords; ++recordIndex)
+        {
+            for (int cellIndex = 0; cellIndex < cellsPerRecord(); ++cellIndex)
+                encodeCell(-1, record + cellIndex * cellSize);
+
+            // Chain the new records in front of the rest of the available list
+            if (recordIndex < numberOfRecords - 1) encodeCell(recordIndex + 1, record + cellSize);
+            else if (recordIndex == numberOfRecords - 1) encodeCell(head, record + cellSize);
+
+            writeBytes(recordIndex, 0, record, recordSize());
+        }
+
+        writeCell(first, 0, 1);
+        if (format == CellFormat::Binary) writeCell(numberOfRecords, 0, RecordsCell);
+
+        if (log && logging)
+        {
+            lock_guard<mutex> lock(logLatch);
+            log->append(WriteAheadLog::GrowEntry, currentOperation, numberOfRecords, 0, nullptr, 0);
+        }
+    }
+
+    // Changes the number of records of the b-tree file, and of the record latches.
+    // The caller holds the b-tree exclusively, so no record latch is held.
+    void setNumberOfRecords(int count)
+    {
+        numberOfRecords = count;
+        if (recordLatches) recordLatches.reset(new shared_mutex[numberOfRecords + 1]);
+        if (filters) filters->resize(numberOfRecords + 1);
+    }
+
+    // Removes the first record of the available list and returns its number.
+    // Returns -1 if there are no empty records.
+    int allocateRecord()
+    {
+        int recordNumber = nextEmpty();
+        if (recordNumber == -1) return -1;
+        writeCell(cell(recordNumber, 1), 0, 1);
+        if (compaction.phase == Compaction::Trim) compaction.allocated = max(compaction.allocated, recordNumber);
+        count(&BTreeCounters::allocations);
+        return recordNumber;
+    }
+
+    // Writes the given sorted pairs in the specified record, spreading them evenly
+    // over newly allocated records as well when they do not fit in one node.
+    // A root that does not fit moves all of its pairs out and grows the b-tree.
+    // Returns the (maximum, record) entries of the written nodes in order.
+    // The caller makes sure there are enough empty records.
+    vector<Pair> writeSpread(int recordNumber, int leafStatus, const vector<Pair>& pairs)
+    {
+        int size = (int) pairs.size();
+        int nodes = nodesFor(size);
+        bool growRoot = recordNumber == 1 && nodes > 1;
+
+        vector<int> records(nodes);
+        for (int n = 0; n < nodes; ++n)
+            records[n] = n == 0 && !growRoot ? recordNumber : allocateRecord();
+
+        // The new leaves go between the original leaf and the one after it
+        bool linked = hasLeafLinks() && leafStatus == 0;
+        int previous = linked && !growRoot ? previousLeaf(recordNumber) : -1;
+        int next = linked && !growRoot ? nextLeaf(recordNumber) : -1;
+
+        vector<Pair> entries;
+        for (int n = 0; n < nodes; ++n)
+        {
+            int begin = (int) ((long long) size * n / nodes), end = (int) ((long long) size * (n + 1) / nodes);
+            NodeView piece(pairs.data() + begin, end - begin);
+            writeWholeNode(leafStatus, piece, records[n],
+                           n == 0 ? previous : records[n - 1],
+                           n == nodes - 1 ? next : records[n + 1]);
+            entries.emplace_back(piece.back().first, records[n]);
+        }
+        if (linked && nodes > 1 && next != -1) linkLeaves(records.back(), next);
+
+        if (growRoot) return writeSpread(1, 1, entries);
+        return entries;
+    }
+
+    // Replaces the given records with the children after the given child of an internal node,
+    // as many as prefetchLeaves. Called at every level of a descent, so the leaves
+    // after the one reached are what remains.
+    void leavesAfter(vector<int>& records, const Value* references, int child, int count)
+    {
+        if (prefetchLeaves == 0) return;
+        records.clear();
+        for (int j = child + 1; j < count && j <= child + prefetchLeaves; ++j) records.push_back((int) references[j]);
+    }
+
+    // Starts reading the given records into the buffer pool in the background,
+    // skipping those the file does not hold yet. Returns the number of records kept.
+    int prefetchRecords(vector<int>& records)
+    {
+        if (!pool || !pool->async()) return 0;
+        records.erase(remove_if(records.begin(), records.end(), [this](int r) { return r >= writtenRecords; }),
+                      records.end());
+        if (!records.empty()) pool->prefetch(records.data(), (int) records.size());
+        return (int) records.size();
+    }
+
+    // Looks up the sorted probes between first and last for searchMany(),
+    // storing the value of each at its index in values. Every level of the b-tree
+    // is read in one pass over the nodes the probes descend to, whose reads are started
+    // together when the buffer pool reads in the background.
+    void searchSorted(const vector<pair<Key, size_t>>& probes, size_t first, size_t last, vector<Value>& values)
+    {
+        LatchGuard shared(treeLatch.get(), false);
+        Key keys[Order > 0 ? Order : m];
+        Value references[Order > 0 ? Order : m];
+
+        // A node with the probes that descend to it, and whether its Bloom filter passed them
+        struct Visit {
+            int record;
+            size_t first, last;
+            bool filtered;
+        };
+        vector<Visit> level{{1, first, last, false}}, next;
+        vector<int> records;
+        while (!level.empty())
+        {
+            if (pool && pool->async())
+            {
+                records.clear();
+                for (const Visit& visit: level) records.push_back(visit.record);
+                prefetchRecords(records);
+            }
+
+            next.clear();
+            for (const Visit& visit: level)
+            {
+                latchRecord(visit.record, false);
+                int status;
+                int count = decodeRecord(visit.record, status, keys, references);
+                if (status == 0)
+                {
+                    // Both the keys of the leaf and the probes are sorted
+                    if (filtering()) filters->build(visit.record, keys, count, false);
+                    int j = 0;
+                    for (size_t p = visit.first; p < visit.last; ++p)
+                    {
+                        while (j < count && keys[j] < probes[p].first) ++j;
+                        int live = j;
+                        while (live < count && keys[live] == probes[p].first && isTombstone(references[live])) ++live;
+                        if (live < count && keys[live] == probes[p].first) values[probes[p].second] = references[live];
+                        else if (visit.filtered && filters->mayContain(visit.record, (uint64_t) probes[p].first))
+                            this->count(&BTreeCounters::bloomFalsePositives);
+                    }
+                }
+                unlatchRecord(visit.record, false);
+                if (status != 1) continue;
+
+                // Hand each child the probes up to its maximum, and the last child the rest
+                for (size_t p = visit.first; p < visit.last;)
+                {
+                    int child = keyLowerBound(keys, count, probes[p].first);
+                    size_t q = p;
+                    if (child >= count - 1)
+                    {
+                        child = count - 1;
+                        q = visit.last;
+                    }
+                    else while (q < visit.last && probes[q].first <= keys[child]) ++q;
+
+                    int record = (int) references[child];
+                    Visit visitChild{record, p, q, false};
+                    p = q;
+
+                    // A leaf whose filter rules out every probe is not read
+                    if (filtering())
+                    {
+                        latchRecord(record, false);
+                        if (filters->built(record))
+                        {
+                            size_t passed = 0;
+                            for (size_t r = visitChild.first; r < visitChild.last; ++r)
+                                passed += filters->mayContain(record, (uint64_t) probes[r].first);
+                            this->count(&BTreeCounters::bloomNegatives, (long long) (visitChild.last - visitChild.first - passed));
+                            visitChild.filtered = true;
+                            if (passed == 0)
+                            {
+                                unlatchRecord(record, false);
+                                continue;
+                            }
+                        }
+                        unlatchRecord(record, false);
+                    }
+                    next.push_back(visitChild);
+                }
+            }
+            level.swap(next);
+        }
+    }
+
+    // Reads the nodes that the sorted batch descends to one level at a time,
+    // starting the reads of a whole level in the background before decoding the first of them.
+    // A level is cut to half of the buffer pool, which is all that prefetch() fills.
+    void prefetchDescents(const vector<Pair>& batch)
+    {
+        if (!pool || !pool->async() || batch.empty()) return;
+        Key keys[Order > 0 ? Order : m];
+        Value references[Order > 0 ? Order : m];
+
+        // The records of a level, each with the first pair of the batch that descends to it,
+        // and the end of the pairs that descend to the level
+        vector<pair<int, size_t>> level{{1, 0}}, next;
+        size_t end = batch.size();
+        vector<int> records;
+        while (!level.empty())
+        {
+            int limit = pool->capacity() / 2;
+            if ((int) level.size() > limit)
+            {
+                end = level[limit].second;
+                level.resize(limit);
+            }
+            records.clear();
+            for (const auto& entry: level) records.push_back(entry.first);
+            prefetchRecords(records);
+
+            next.clear();
+            for (size_t n = 0; n < level.size(); ++n)
+            {
+                int status;
+                int count = decodeRecord(level[n].first, status, keys, references);
+                if (status != 1) continue;
+
+                size_t last = n + 1 < level.size() ? level[n + 1].second : end;
+                for (size_t p = level[n].second; p < last;)
+                {
+                    int child = keyLowerBound(keys, count, batch[p].first);
+                    if (child >= count - 1)
+                    {
+                        next.emplace_back((int) references[count - 1], p);
+                        break;
+                    }
+                    next.emplace_back((int) references[child], p);
+                    while (p < last && batch[p].first <= keys[child]) ++p;
+                }
+            }
+            level.swap(next);
+        }
+    }
+
+    // Opens the b-tree's file with the given storage backend.
+    // The file is truncated unless told otherwise.
+    void openFile(StorageBackend backend, bool truncate = true)
+    {
+        if (backend == StorageBackend::Mapped || backend == StorageBackend::Positional)
+        {
+#ifndef _WIN32
+            if (backend == StorageBackend::Mapped) file.reset(new MappedStorage(path, truncate));
+            else file.reset(new PositionalStorage(path, truncate));
+            return;
+#else
+            throw UnsupportedStorage(path);
+#endif
+        }
+        file.reset(new StreamStorage(path, truncate));
+    }
+
+    // Opens the background I/O of the buffer pool on the b-tree's file.
+    // Uring falls back to Threads where io_uring is not available.
+    unique_ptr<AsyncIO> openAsync(const BTreeOptions& options)
+    {
+#ifndef _WIN32
+#ifdef BTREE_IO_URING
+        if (options.asyncIO == AsyncBackend::Uring)
+        {
+            try
+            {
+                return unique_ptr<AsyncIO>(new UringIO(path, options.ioQueueDepth, *file));
+            }
+            catch (const UnsupportedStorage&) {}
+        }
+#endif
+        return unique_ptr<AsyncIO>(new ThreadPoolIO(path, options.ioQueueDepth, options.ioThreads, *file));
+#else
+        throw UnsupportedStorage(path);
+#endif
+    }
+
+    // Returns the integer value that the specified cell holds.
+    // The cells that hold record numbers and statuses fit in an int.
+    int cell(int rowIndex, int columnIndex)
+    {
+        return (int) cellValue(rowIndex, columnIndex);
+    }
+
+    // Returns the full value that the specified cell holds, which may be a key or a value.
+    int64_t cellValue(int rowIndex, int columnIndex)
+    {
+        // Read and return the integer value in the cell
+        char cell[cellSize];
+        readBytes(rowIndex, columnIndex * cellSize, cell, cellSize);
+        return decodeCell(cell);
+    }
+
+    // Appends the commit entry of the operation running on this thread.
+    void endOperation()
+    {
+        if (!log) return;
+        lock_guard<mutex> lock(logLatch);
+        log->append(WriteAheadLog::CommitEntry, currentOperation, 0, 0, nullptr, 0);
+        ++uncommittedOperations;
+    }
+
+    // Writes and syncs the log, then applies the unapplied records to the b-tree file.
+    // Every checkpointCommits commits, or when asked to, also syncs the b-tree file
+    // and empties the log. The caller holds the b-tree exclusively.
+    void commitLog(bool forceCheckpoint)
+    {
+        if (!log) return;
+        lock_guard<mutex> lock(logLatch);
+        unique_lock<shared_mutex> unapplied(unappliedLatch);
+
+        bool committed = log->pending() || !unappliedRecords.empty();
+        if (committed)
+        {
+            log->commit();
+            for (const auto& record: unappliedRecords) storeRecord(record.first, record.second.data());
+            unappliedRecords.clear();
+            uncommittedOperations = 0;
+            ++commits;
+        }
+
+        if (forceCheckpoint || (committed && commits % checkpointCommits == 0))
+        {
+            if (pool) pool->flush();
+            file->sync();
+            resetLog();
+        }
+    }
+
+    // Empties the log, which then starts with the number of records of the b-tree file.
+    void resetLog()
+    {
+        if (!log) return;
+        long long operation = nextOperation++;
+        log->append(WriteAheadLog::GrowEntry, operation, numberOfRecords, 0, nullptr, 0);
+        log->append(WriteAheadLog::CommitEntry, operation, 0, 0, nullptr, 0);
+        log->reset();
+    }
+
+    // Commits the logged operations and logs the start of a bulk load,
+    // whose writes then go straight to the b-tree file.
+    void beginBulkLoad()
+    {
+        if (!log) return;
+        commitLog(false);
+        {
+            lock_guard<mutex> lock(logLatch);
+            long long operation = nextOperation++;
+            log->append(WriteAheadLog::BulkLoadEntry, operation, 0, 0, nullptr, 0);
+            log->append(WriteAheadLog::CommitEntry, operation, 0, 0, nullptr, 0);
+            log->commit();
+        }
+        logging = false;
+    }
+
+    // Makes a finished bulk load durable, which empties the log.
+    // A bulk load interrupted by a crash is replayed as an empty b-tree.
+    void endBulkLoad()
+    {
+        if (!log) return;
+        logging = true;
+        commitLog(true);
+    }
+
+    // Applies the operations committed to the given log entries to the b-tree file,
+    // which holds every operation before them.
+    void recover(const vector<WriteAheadLog::Entry>& entries)
+    {
+        unordered_map<long long, bool> committed;
+        for (const auto& entry: entries)
+            if (entry.type == WriteAheadLog::CommitEntry) committed[entry.operation] = true;
+
+        for (const auto& entry: entries)
+        {
+            if (!committed.count(entry.operation)) continue;
+            if (entry.type == WriteAheadLog::WriteEntry)
+                writeFileBytes(entry.recordNumber, entry.offset, entry.bytes.data(), (int) entry.bytes.size());
+            else if (entry.type == WriteAheadLog::GrowEntry)
+                setNumberOfRecords(entry.recordNumber);
+            else if (entry.type == WriteAheadLog::BulkLoadEntry)
+                initialize();
+        }
+        file->sync();
+    }
+
+    // Reads the whole record with the given number as stored,
+    // through the buffer pool if it is enabled.
+    void loadRecord(int recordNumber, char* record)
+    {
+        if (pool) pool->read(recordNumber, 0, record, recordSize());
+        else readRecord(recordNumber, record);
+    }
+
+    // Writes the whole record with the given number,
+    // through the buffer pool if it is enabled.
+    void storeRecord(int recordNumber, const char* record)
+    {
+        if (pool) pool->write(recordNumber, 0, record, recordSize());
+        else writeRecord(recordNumber, record);
+    }
+
+    // Returns true if the Bloom filters apply to the reads of this thread,
+    // which they do not in a snapshot: they hold the current keys of the leaves.
+    bool filtering() const
+    {
+        return filters && readingSnapshot.first != this;
+    }
+
+    // Returns the shard that keeps the images of the given record.
+    VersionShard& versionShard(int recordNumber)
+    {
+        return versions[recordNumber % versionShards];
+    }
+
+    // Returns the image of the given record that the snapshot with the given epoch sees,
+    // or null if the record has not changed since. The caller holds the latch of its shard.
+    const char* snapshotImage(int recordNumber, long long epoch)
+    {
+        const auto& images = versionShard(recordNumber).images;
+        auto it = images.find(recordNumber);
+        if (it == images.end()) return nullptr;
+        for (const auto& image: it->second)
+            if (image.first >= epoch) return image.second.data();
+        return nullptr;
+    }
+
+    // Keeps the current image of the given record before it changes, if a live snapshot
+    // taken since its last kept image needs it. The caller holds the snapshot latch shared
+    // and the latch of the shard of the record.
+    void preserveRecord(int recordNumber)
+    {
+        auto& images = versionShard(recordNumber).images;
+        auto it = images.find(recordNumber);
+        long long lastTag = it == images.end() || it->second.empty() ? 0 : it->second.back().first;
+        if (liveSnapshots.upper_bound(lastTag) == liveSnapshots.end()) return;
+
+        vector<char> image(recordSize());
+        readCurrentBytes(recordNumber, 0, image.data(), recordSize());
+        images[recordNumber].emplace_back(latestSnapshot, move(image));
+        versionImages.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Keeps the images that live snapshots need of the records from first to last, exclusive.
+    void preserveRecords(int first, int last)
+    {
+        shared_lock<shared_mutex> epochs(snapshotLatch);
+        for (int i = first; i < last; ++i)
+        {
+            lock_guard<mutex> lock(versionShard(i).latch);
+            preserveRecord(i);
+        }
+    }
+
+    // Ends the snapshot with the given epoch, and drops the images
+    // that only snapshots older than every live one needed.
+    void releaseSnapshot(long long epoch)
+    {
+        unique_lock<shared_mutex> epochs(snapshotLatch);
+        liveSnapshots.erase(epoch);
+        snapshotting.store(!liveSnapshots.empty(), memory_order_release);
+
+        long long oldest = liveSnapshots.empty() ? LLONG_MAX : *liveSnapshots.begin();
+        for (VersionShard& shard: versions)
+        {
+            lock_guard<mutex> lock(shard.latch);
+            for (auto it = shard.images.begin(); it != shard.images.end();)
+            {
+                auto& images = it->second;
+                auto kept = find_if(images.begin(), images.end(), [&](const auto& image) { return image.first >= oldest; });
+                versionImages.fetch_sub(kept - images.begin(), memory_order_relaxed);
+                images.erase(images.begin(), kept);
+                it = images.empty() ? shard.images.erase(it) : next(it);
+            }
+        }
+    }
+
+    // Reads size bytes at the given offset of the specified record,
+    // as the snapshot this thread reads through saw it, if any.
+    void readBytes(int recordNumber, int offset, char* bytes, int size)
+    {
+        if (readingSnapshot.first == this)
+        {
+            lock_guard<mutex> lock(versionShard(recordNumber).latch);
+            const char* image = snapshotImage(recordNumber, readingSnapshot.second);
+            if (image) memcpy(bytes, image + offset, size);
+            else readCurrentBytes(recordNumber, offset, bytes, size);
+            return;
+        }
+        readCurrentBytes(recordNumber, offset, bytes, size);
+    }
+
+    // Reads size bytes at the given offset of the specified record,
+    // from the buffer pool if it is enabled.
+    void readCurrentBytes(int recordNumber, int offset, char* bytes, int size)
+    {
+        // Logged writes are not in the b-tree file until their group commit
+        if (log)
+        {
+            shared_lock<shared_mutex> unapplied(unappliedLatch);
+            auto it = unappliedRecords.find(recordNumber);
+            if (it != unappliedRecords.end())
+            {
+                memcpy(bytes, it->second.data() + offset, size);
+                return;
+            }
+        }
+
+        if (pool)
+        {
+            pool->read(recordNumber, offset, bytes, size);
+            return;
+        }
+
+        readFileBytes(recordNumber, offset, bytes, size);
+    }
+
+    // Writes size bytes at the given offset of the specified record,
+    // keeping the image that live snapshots see of it.
+    void writeBytes(int recordNumber, int offset, const char* bytes, int size)
+    {
+        // Writes of the leaf links leave the keys of a leaf as they are
+        if (filters && offset < (1 + 2 * order()) * cellSize) filters->invalidate(recordNumber);
+
+        if (snapshotting.load(memory_order_acquire))
+        {
+            shared_lock<shared_mutex> epochs(snapshotLatch);
+            lock_guard<mutex> lock(versionShard(recordNumber).latch);
+            preserveRecord(recordNumber);
+            writeCurrentBytes(recordNumber, offset, bytes, size);
+            return;
+        }
+        writeCurrentBytes(recordNumber, offset, bytes, size);
+    }
+
+    // Writes size bytes at the given offset of the specified record,
+    // to the buffer pool if it is enabled.
+    void writeCurrentBytes(int recordNumber, int offset, const char* bytes, int size)
+    {
+        // Log the write, and keep it in memory until its group commit
+        if (log && logging)
+        {
+            lock_guard<mutex> lock(logLatch);
+            log->append(WriteAheadLog::WriteEntry, currentOperation, recordNumber, offset, bytes, size);
+
+            unique_lock<shared_mutex> unapplied(unappliedLatch);
+            auto it = unappliedRecords.find(recordNumber);
+            if (it == unappliedRecords.end())
+            {
+                vector<char> record(recordSize());
+                loadRecord(recordNumber, record.data());
+                it = unappliedRecords.emplace(recordNumber, move(record)).first;
+            }
+            memcpy(it->second.data() + offset, bytes, size);
+            return;
+        }
+
+        if (pool)
+        {
+            pool->write(recordNumber, offset, bytes, size);
+            return;
+        }
+
+        writeFileBytes(recordNumber, offset, bytes, size);
+    }
+
+    // Reads size bytes at the given offset of the specified record from the b-tree file.
+    void readFileBytes(int recordNumber, int offset, char* bytes, int size)
+    {
+        if (recordNumber >= writtenRecords)
+        {
+            char record[recordSize()];
+            unwrittenRecord(recordNumber, record);
+            memcpy(bytes, record + offset, size);
+            return;
+        }
+
+        file->read((long long) recordNumber * recordSize() + offset, bytes, size);
+    }
+
+    // Writes size bytes at the given offset of the specified record to the b-tree file.
+    void writeFileBytes(int recordNumber, int offset, const char* bytes, int size)
+    {
+        // The rest of an unwritten record is written along with the bytes
+        if (recordNumber >= writtenRecords)
+        {
+            char record[recordSize()];
+            unwrittenRecord(recordNumber, record);
+            memcpy(record + offset, bytes, size);
+            writeRecord(recordNumber, record);
+            return;
+        }
+
+        file->write((long long) recordNumber * recordSize() + offset, bytes, size);
+    }
+
+    // Reads the whole record with the given number from the b-tree file.
+    void readRecord(int recordNumber, char* record)
+    {
+        if (recordNumber >= writtenRecords) unwrittenRecord(recordNumber, record);
+        else file->read((long long) recordNumber * recordSize(), record, recordSize());
+    }
+
+    // Writes the whole record with the given number to the b-tree file.
+    void writeRecord(int recordNumber, const char* record)
+    {
+        // The written records stay contiguous, so the file size tells how many there are
+        writeUnwrittenRecords(recordNumber);
+        file->write((long long) recordNumber * recordSize(), record, recordSize());
+        if (recordNumber >= writtenRecords) writtenRecords = recordNumber + 1;
+    }
+
+    // Writes the unwritten records before the given record number to the b-tree file.
+    void writeUnwrittenRecords(int recordNumber)
+    {
+        char record[recordSize()];
+        for (; writtenRecords < recordNumber; ++writtenRecords)
+        {
+            unwrittenRecord(writtenRecords, record);
+            file->write((long long) writtenRecords * recordSize(), record, recordSize());
+        }
+    }
+
+    // Fills the given buffer with the record with the given number as it is before it is written:
+    // an empty record that links to the next one in the initial available list.
+    void unwrittenRecord(int recordNumber, char* record) const
+    {
+        // Fill the record with -1s, where -1 in the first cell indicates
+        // an empty record (available for allocation)
+        for (int cellIndex = 0; cellIndex < cellsPerRecord(); ++cellIndex)
+            encodeCell(-1, record + cellIndex * cellSize);
+
+        // Write the number of the next empty record
+        // in the available list
+        if (recordNumber != numberOfRecords - 1)
+            encodeCell(recordNumber + 1, record + cellSize);
+    }
+
+    // Sets writtenRecords from the size of the b-tree file. A mapped file can end
+    // with zeros after a crash, and a record of zeros is never written.
+    void findWrittenRecords()
+    {
+        int count = (int) (file->size() / recordSize());
+        char record[recordSize()];
+        for (; count > 0; --count)
+        {
+            file->read((long long) (count - 1) * recordSize(), record, recordSize());
+            if (any_of(record, record + recordSize(), [](char c) { return c != 0; })) break;
+        }
+        writtenRecords = count;
+    }
+
+    // Validates the header of the existing b-tree file and takes its number of records.
+    // Returns false if the file is empty.
+    bool readHeader()
+    {
+        if (writtenRecords == 0) return false;
+
+        if (format == CellFormat::Binary)
+        {
+            if (cell(0, MagicCell) != headerMagic || cell(0, VersionCell) != headerVersion
+                || cell(0, OrderCell) != order() || cell(0, CellSizeCell) != cellSize || cell(0, RecordsCell) < 1)
+                throw InvalidHeader(path);
+            setNumberOfRecords(cell(0, RecordsCell));
+        }
+        else
+        {
+            // A text file has no header, but record 0 never holds a node
+            if (cell(0, 0) != -1) throw InvalidHeader(path);
+            setNumberOfRecords(max(numberOfRecords, writtenRecords - 1));
+        }
+
+        int head = cell(0, 1);
+        if (head < -1 || head == 0 || head > numberOfRecords) throw InvalidHeader(path);
+        return true;
+    }
+
+    // Decodes the integer value held in the cellSize bytes at the given address.
+    int64_t decodeCell(const char* cell) const
+    {
+        if (format == CellFormat::Text) return ctoi(cell, cellSize);
+
+        // Assemble the little-endian bytes
+        uint64_t value = 0;
+        for (int i = cellSize - 1; i >= 0; --i)
+            value = (value << 8) | (unsigned char) cell[i];
+
+        if (cellSize == 4) return (int32_t) (uint32_t) value;
+        return (int64_t) value;
+    }
+
+    // Encodes the given value into the cellSize bytes at the given address.
+    void encodeCell(int64_t value, char* cell) const
+    {
+        if (format == CellFormat::Text)
+        {
+            char digits[24];
+            int length = (int) (to_chars(digits, digits + sizeof digits, value).ptr - digits);
+            int i = 0;
+            for (; i < cellSize && i < length; ++i) cell[i] = digits[i];
+            for (; i < cellSize; ++i) cell[i] = ' ';
+            return;
+        }
+
+        // Store the sign-extended value in little-endian byte order
+        uint64_t bits = (uint64_t) value;
+        for (int i = 0; i < cellSize; ++i, bits >>= 8)
+            cell[i] = (char) (bits & 0xff);
+    }
+
+    // Writes the given value in the specified cell
+    // in the b-tree file.
+    void writeCell(int value, int rowIndex, int columnIndex)
+    {
+        // Write the given value in the cell
+        char cell[cellSize];
+        encodeCell(value, cell);
+        writeBytes(rowIndex, columnIndex * cellSize, cell, cellSize);
+    }
+
+    // Asserts the given record number is within a valid range.
+    // This valid range depends on the maximum number of records
+    // that the b-tree file can hold.
+    void validateRecordNumber(int recordNumber) const
+    {
+        // If the record number is not between 1 and numberOfRecords
+        if (recordNumber <= 0 || recordNumber > numberOfRecords)
+        // then it is not a valid record number
+        throw InvalidRecordNumber(recordNumber);
+    }
+
+    // Asserts the given pair number is within a valid range.
+    // This valid range depends on the maximum number of values
+    // a record in the b-tree file can hold.
+    void validatePairNumber(int pairNumber) const
+    {
+        // If the pair number is not between 1 and m
+        if (pairNumber <= 0 || pairNumber > order())
+        // then it is not a valid pair number
+        throw InvalidPairNumber(pairNumber);
+    }
+
+    // Initializes the b-tree file with -1s
+    // and the available list.
+    // Only record 0 is written; the others are written when they are first used.
+    void initialize()
+    {
+        // Replacing the file changes every written record under live snapshots
+        if (snapshotting.load(memory_order_acquire)) preserveRecords(0, writtenRecords);
+
+        char record[recordSize()];
+        unwrittenRecord(0, record);
+
+        // Record 0 of a binary file also holds the header
+        if (format == CellFormat::Binary)
+        {
+            encodeCell(headerMagic, record + MagicCell * cellSize);
+            encodeCell(headerVersion, record + VersionCell * cellSize);
+            encodeCell(order(), record + OrderCell * cellSize);
+            encodeCell(cellSize, record + CellSizeCell * cellSize);
+            encodeCell(numberOfRecords, record + RecordsCell * cellSize);
+        }
+
+        file->write(0, record, recordSize());
+        file->resize(recordSize());
+        writtenRecords = 1;
+
+        // Cached records and filters no longer match the file
+        if (pool) pool->discard();
+        if (filters) filters->clear();
+        compaction = Compaction();
+    }
+
+    // Writes the pairs of the given node in the specified record,
+    // filling the rest of the record with -1s.
+    void writeNode(NodeView node, int recordNumber)
+    {
+        countNode(&BTreeCounters::OperationCounters::nodeWrites);
+        char pairs[2 * order() * cellSize];
+        for (int i = 0; i < 2 * order(); ++i) encodeCell(-1, pairs + i * cellSize);
+        for (int i = 0; i < (int) node.size() && i < order(); ++i)
+        {
+            encodeCell(node[i].first, pairs + 2 * i * cellSize);
+            encodeCell(node[i].second, pairs + (2 * i + 1) * cellSize);
+        }
+
+        writeBytes(recordNumber, cellSize, pairs, 2 * order() * cellSize);
+        if (filters && leafStatus(recordNumber) == 0) buildFilter(recordNumber, node);
+    }
+
+    // Builds the Bloom filter of the given leaf from its pairs.
+    // The caller holds the leaf exclusively.
+    void buildFilter(int recordNumber, NodeView node)
+    {
+        Key keys[Order > 0 ? Order : m];
+        int count = min(node.size(), order());
+        for (int i = 0; i < count; ++i) keys[i] = node[i].first;
+        filters->build(recordNumber, keys, count, true);
+    }
+
+    // Builds the Bloom filters of every leaf in the b-tree file.
+    void rebuildFilters()
+    {
+        Key keys[Order > 0 ? Order : m];
+        Value references[Order > 0 ? Order : m];
+        for (int i = 1; i < min((int) writtenRecords, numberOfRecords); ++i)
+        {
+            int status;
+            int count = decodeRecord(i, status, keys, references);
+            if (status == 0) filters->build(i, keys, count, true);
+        }
+    }
+
+    void markLeaf(int recordNumber, int leafStatus)
+    {
+        writeCell(leafStatus, recordNumber, 0);
+    }
+
+    // Applies the given changes to the entries of a parent node in place.
+    // Returns false if the parent stays the same.
+    bool applyChanges(vector<Pair>& parent, const SeparatorChanges& changes)
+    {
+        bool changed = false;
+        for (const auto& change: changes)
+        {
+            if (change.kind == SeparatorChange::Added)
+            {
+                parent.emplace_back(change.maximum, change.record);
+                changed = true;
+                continue;
+            }
+
+            auto entry = find_if(parent.begin(), parent.end(),
+                                 [&](const Pair& p) { return p.second == change.record; });
+            if (entry == parent.end()) continue;
+            if (change.kind == SeparatorChange::Removed)
+            {
+                parent.erase(entry);
+                changed = true;
+            }
+            else if (entry->first != change.maximum)
+            {
+                entry->first = change.maximum;
+                changed = true;
+            }
+        }
+
+        if (changed) sort(parent.begin(), parent.end());
+        return changed;
+    }
+
+    // Applies the changes to the entries of its children to the given parent.
+    // Returns the changes to its own entry in the grandparent,
+    // or none if the parent did not change.
+    SeparatorChanges updateAfterInsert(int parentRecordNumber, const SeparatorChanges& changes)
+    {
+        Scratch<Pair> newParent;
+        node(parentRecordNumber, *newParent);
+        if (!applyChanges(*newParent, changes)) return {};
+
+        // If record overflowed after insertion
+        if ((int) newParent->size() > order())
+            return split(parentRecordNumber, *newParent);
+
+        // Write new parent
+        writeNode(*newParent, parentRecordNumber);
+        return {{parentRecordNumber, newParent->back().first, SeparatorChange::Updated}};
+    }
+
+    void clearRecord(int recordNumber)
+    {
+        writeNode({}, recordNumber);
+    }
+
+    // Returns the number of the leaf after the given leaf, or -1 if it is the last.
+    int nextLeaf(int recordNumber)
+    {
+        return cell(recordNumber, nextLeafCell());
+    }
+
+    // Returns the number of the leaf before the given leaf, or -1 if it is the first.
+    int previousLeaf(int recordNumber)
+    {
+        return cell(recordNumber, previousLeafCell());
+    }
+
+    // Clears the links of a record that is no longer a leaf.
+    void unlinkLeaf(int recordNumber)
+    {
+        if (!hasLeafLinks()) return;
+        writeCell(-1, recordNumber, nextLeafCell());
+        writeCell(-1, recordNumber, previousLeafCell());
+    }
+
+    // Links two neighbouring leaves; either of them may be -1.
+    void linkLeaves(int left, int right)
+    {
+        if (left != -1) writeCell(right, left, nextLeafCell());
+        if (right != -1) writeCell(left, right, previousLeafCell());
+    }
+
+    void markNonLeaf(int recordNumber)
+    {
+        writeCell(1, recordNumber, 0);
+    }
+
+    int leafStatus(int recordNumber)
+    {
+        return cell(recordNumber, 0);
+    }
+
+    void markEmpty(int recordNumber)
+    {
+        writeCell(-1, recordNumber, 0);
+    }
+
+    // Moves the nearest pair of a sibling into the underflowed node, if the sibling can spare it.
+    // The first child borrows from its right sibling, the others from their left one.
+    // Returns the changes to the entries of both in the parent, or none if it cannot.
+    SeparatorChanges redistribute(int parentRecordNumber, int currentRecordNumber, NodeView underflowed)
+    {
+        Scratch<Pair> parentBuffer, siblingBuffer, currentBuffer;
+        vector<Pair>& parent = *parentBuffer;
+        vector<Pair>& sibling = *siblingBuffer;
+        vector<Pair>& currentNode = *currentBuffer;
+        node(parentRecordNumber, parent);
+        currentNode.assign(underflowed.begin(), underflowed.end());
+
+        if (parent[0].second == currentRecordNumber)
+        {
+            // Merging into a right sibling that cannot spare a pair never overflows it
+            if (parent.size() < 2) return {};
+            int siblingRecordNumber = (int) parent[1].second;
+            node(siblingRecordNumber, sibling);
+            if ((int) sibling.size() <= order() / 2) return {};
+
+            currentNode.push_back(sibling.front());
+            sibling.erase(sibling.begin());
+            writeNode(currentNode, currentRecordNumber);
+            writeNode(sibling, siblingRecordNumber);
+            count(&BTreeCounters::redistributions);
+            return {{currentRecordNumber, currentNode.back().first, SeparatorChange::Updated},
+                    {siblingRecordNumber, sibling.back().first, SeparatorChange::Updated}};
+        }
+
+        // For each pair in parent node
+        for (int i = 0; i + 1 < (int) parent.size(); ++i) {
+        // If the pair after the current pair is pointing to the record where deletion happened
+        // i.e. If we reached the pair to left of the pair where the deletion happened
+        if (parent[i + 1].second == currentRecordNumber)
+        {
+            int siblingRecordNumber = (int) parent[i].second;
+            node(siblingRecordNumber, sibling);
+            // Check the size of the child node of this pair
+            // If it is going to be less than m/2 after redistribution, do nothing and return false
+            if ((int) sibling.size() <= order() / 2)
+            {
+                return {};
+            }
+            else
+            {   // Otherwise, if we can redistribute
+                // Take one pair from sibling and put it in the node where deletion happened
+                    currentNode.push_back(sibling.back());
+
+                    // Remove the moved pair from the sibling node
+                    sibling.pop_back();
+
+                    // Sort the current node and write both nodes
+                    sort(currentNode.begin(), currentNode.end());
+                    clearRecord(currentRecordNumber);
+                    writeNode(currentNode, currentRecordNumber);
+                    clearRecord(siblingRecordNumber);
+                    writeNode(sibling, siblingRecordNumber);
+                    count(&BTreeCounters::redistributions);
+                    return {{currentRecordNumber, currentNode.back().first, SeparatorChange::Updated},
+                            {siblingRecordNumber, sibling.back().first, SeparatorChange::Updated}};
+                }
+            }
+        }
+        return {};
+    }
+
+    // Moves the pairs of the underflowed node into a sibling and frees its record.
+    // Returns the changes to the entries of both in the parent,
+    // or none if the node has no sibling.
+    SeparatorChanges merge(int parentRecordNumber, int currentRecordNumber, NodeView currentNode)
+    {
+        Scratch<Pair> parentBuffer, siblingBuffer;
+        vector<Pair>& parent = *parentBuffer;
+        vector<Pair>& sibling = *siblingBuffer;
+        node(parentRecordNumber, parent);
+
+        if (parent[0].second == currentRecordNumber)
+        {
+            if (parent.size() > 1)
+            {
+                int siblingRecordNumber = (int) parent[1].second;
+                node(siblingRecordNumber, sibling);
+                sibling.insert(sibling.end(), currentNode.begin(), currentNode.end());
+                sort(sibling.begin(), sibling.end());
+                writeNode(sibling, siblingRecordNumber);
+
+                // The sibling follows the merged leaf
+                if (hasLeafLinks() && isLeaf(currentRecordNumber))
+                    linkLeaves(previousLeaf(currentRecordNumber), siblingRecordNumber);
+
+                freeRecord(currentRecordNumber);
+                count(&BTreeCounters::merges);
+                return {{siblingRecordNumber, sibling.back().first, SeparatorChange::Updated},
+                        {currentRecordNumber, 0, SeparatorChange::Removed}};
+            }
+            return {};
+        }
+        // For each pair in parent node
+        for (int i = 0; i + 1 < (int) parent.size(); ++i)
+        {
+            // If the pair after the current pair is pointing to the record where deletion happened
+            // i.e. If we reached the pair to left of the pair where the deletion happened
+            if (parent[i + 1].second == currentRecordNumber)
+            {
+                int siblingRecordNumber = (int) parent[i].second;
+                node(siblingRecordNumber, sibling);
+                sibling.insert(sibling.end(), currentNode.begin(), currentNode.end());
+                sort(sibling.begin(), sibling.end());
+                writeNode(sibling, siblingRecordNumber);
+
+                // The sibling precedes the merged leaf
+                if (hasLeafLinks() && isLeaf(currentRecordNumber))
+                    linkLeaves(siblingRecordNumber, nextLeaf(currentRecordNumber));
+
+                freeRecord(currentRecordNumber);
+                count(&BTreeCounters::merges);
+                return {{siblingRecordNumber, sibling.back().first, SeparatorChange::Updated},
+                        {currentRecordNumber, 0, SeparatorChange::Removed}};
+            }
+        }
+        return {};
+    }
+
+    // Applies the changes to the entries of its children to the given parent.
+    // Returns the changes to the entries of the grandparent,
+    // or none if the parent did not change.
+    SeparatorChanges updateAfterDelete(int parentRecordNumber, int grandParentRecordNumber,
+                                       const SeparatorChanges& changes)
+    {
+        Scratch<Pair> newParent;
+        node(parentRecordNumber, *newParent);
+        if (!applyChanges(*newParent, changes)) return {};
+
+        return writeOrRebalance(grandParentRecordNumber, parentRecordNumber, *newParent);
+        }
+
+    // Applies the changes to the entries of the last visited node to its ancestors,
+    // from the nearest up, until one of them is left unchanged.
+    void updateAncestors(vector<int>& visited, SeparatorChanges changes)
+    {
+        while (!visited.empty() && !changes.empty()) {
+            int lastVisitedIndex = visited.back();
+            visited.pop_back();
+            if (!visited.empty())
+                changes = updateAfterDelete(lastVisitedIndex, visited.back(), changes);
+            else
+                changes = updateAfterDelete(lastVisitedIndex, -1, changes);
+        }
+    }
+
+    // Takes the tombstones out of the leaf that the given key descends to,
+    // rebalancing it once for all of them. The caller holds the b-tree exclusively.
+    void purgeLeaf(Key recordId)
+    {
+        Scratch<int> visited;
+        int currentRecordNumber = 1, parentRecordNumber = -1;
+        while (!isLeaf(currentRecordNumber))
+        {
+            visited->push_back(currentRecordNumber);
+            parentRecordNumber = currentRecordNumber;
+            currentRecordNumber = childFor(currentRecordNumber, recordId);
+        }
+
+        Scratch<Pair> current;
+        node(currentRecordNumber, *current);
+        if (!dropTombstones(*current)) return;
+        updateAncestors(*visited, writePurged(parentRecordNumber, currentRecordNumber, *current));
+    }
+
+    // Writes a leaf whose tombstones were taken out, rebalancing it if it underflowed.
+    // Returns the changes to the entries of the parent.
+    SeparatorChanges writePurged(int parentRecordNumber, int currentRecordNumber, NodeView current)
+    {
+        if ((int) current.size() < order() / 2 && parentRecordNumber != -1)
+            return rebalancePurged(parentRecordNumber, currentRecordNumber, current);
+        return writeOrRebalance(parentRecordNumber, currentRecordNumber, current);
+    }
+
+    // Rebalances a leaf that purging left any number of pairs short of m / 2 with the sibling
+    // that merge() would take: their pairs are spread evenly over both if they fill
+    // two halves, and merged into the sibling otherwise.
+    // Returns the changes to the entries of both in the parent.
+    SeparatorChanges rebalancePurged(int parentRecordNumber, int currentRecordNumber, NodeView current)
+    {
+        Scratch<Pair> parentBuffer, siblingBuffer, pairsBuffer;
+        vector<Pair>& parent = *parentBuffer;
+        vector<Pair>& sibling = *siblingBuffer;
+        vector<Pair>& pairs = *pairsBuffer;
+        node(parentRecordNumber, parent);
+        if (parent.size() < 2) return writeOrRebalance(-1, currentRecordNumber, current);
+
+        int index = 0;
+        while (index < (int) parent.size() && parent[index].second != currentRecordNumber) ++index;
+        bool first = index == 0;
+        int siblingRecordNumber = (int) parent[first ? 1 : index - 1].second;
+        node(siblingRecordNumber, sibling);
+        if ((int) (sibling.size() + current.size()) < 2 * (order() / 2))
+            return merge(parentRecordNumber, currentRecordNumber, current);
+
+        // The left node of the two takes the first half of their pairs
+        int left = first ? currentRecordNumber : siblingRecordNumber;
+        int right = first ? siblingRecordNumber : currentRecordNumber;
+        pairs.assign(current.begin(), current.end());
+        pairs.insert(first ? pairs.end() : pairs.begin(), sibling.begin(), sibling.end());
+
+        int half = (int) pairs.size() / 2;
+        writeNode(NodeView(pairs.data(), half), left);
+        writeNode(NodeView(pairs.data() + half, (int) pairs.size() - half), right);
+        count(&BTreeCounters::redistributions);
+        return {{left, pairs[half - 1].first, SeparatorChange::Updated},
+                {right, pairs.back().first, SeparatorChange::Updated}};
+    }
+
+    // Returns true if the reference marks a removed pair. -2 is an ordinary
+    // reference unless removals leave tombstones.
+    bool isTombstone(Value reference) const
+    {
+        return tombstoneRatio > 0 && reference == tombstone;
+    }
+
+    // Returns the first pair of the leaf with the given key that is not a tombstone,
+    // or the end of the leaf if there is none.
+    typename vector<Pair>::iterator livePair(vector<Pair>& leaf, Key recordId)
+    {
+        auto position = lower_bound(leaf.begin(), leaf.end(), Pair{recordId, numeric_limits<Value>::min()});
+        while (position != leaf.end() && position->first == recordId && isTombstone(position->second)) ++position;
+        return position != leaf.end() && position->first == recordId ? position : leaf.end();
+    }
+
+    // Replaces the tombstone of the given key in the leaf with a pair of the given reference,
+    // which keeps the keys of the leaf and so its entry in the parent.
+    // Returns false if the key has no tombstone.
+    bool reviveTombstone(vector<Pair>& leaf, Key recordId, Value reference) const
+    {
+        if (tombstoneRatio <= 0) return false;
+        auto position = lower_bound(leaf.begin(), leaf.end(), Pair{recordId, tombstone});
+        if (position == leaf.end() || *position != Pair{recordId, tombstone}) return false;
+        leaf.erase(position);
+        Pair p{recordId, reference};
+        leaf.insert(upper_bound(leaf.begin(), leaf.end(), p), p);
+        return true;
+    }
+
+    // Takes the tombstones out of the pairs of a leaf. Returns false if there were none.
+    bool dropTombstones(vector<Pair>& leaf) const
+    {
+        if (tombstoneRatio <= 0) return false;
+        auto end = std::remove_if(leaf.begin(), leaf.end(), [this](const Pair& p) { return isTombstone(p.second); });
+        if (end == leaf.end()) return false;
+        leaf.erase(end, leaf.end());
+        return true;
+    }
+
+    // Returns true if the tombstones of a leaf are more than tombstoneRatio of its pairs.
+    bool overTombstoneRatio(const vector<Pair>& leaf) const
+    {
+        long long tombstones = count_if(leaf.begin(), leaf.end(), [this](const Pair& p) { return isTombstone(p.second); });
+        return tombstones > tombstoneRatio * (double) leaf.size();
+    }
+
+    // Writes the given node after a removal, redistributing or merging it
+    // with a sibling if it underflowed. A node without a parent or a sibling
+    // is written as it is. Returns the changes to the entries of the parent.
+    SeparatorChanges writeOrRebalance(int parentRecordNumber, int currentRecordNumber, NodeView current)
+    {
+        // If record underflowed after deletion
+        if ((int) current.size() < order() / 2 && parentRecordNumber != -1)
+        {
+            auto changes = redistribute(parentRecordNumber, currentRecordNumber, current);
+            if (changes.empty()) changes = merge(parentRecordNumber, currentRecordNumber, current);
+            if (!changes.empty()) return changes;
+        }
+
+        if (!current.empty() || currentRecordNumber == 1)
+        {
+            writeNode(current, currentRecordNumber);
+
+            // An emptied root is an empty leaf
+            if (current.empty() && !isLeaf(1))
+            {
+                markLeaf(1, 0);
+                unlinkLeaf(1);
+            }
+            return {{currentRecordNumber, current.empty() ? 0 : current.back().first, SeparatorChange::Updated}};
+        }
+
+        // An emptied node is freed and dropped from its parent
+        if (hasLeafLinks() && isLeaf(currentRecordNumber))
+            linkLeaves(previousLeaf(currentRecordNumber), nextLeaf(currentRecordNumber));
+        freeRecord(currentRecordNumber);
+        return {{currentRecordNumber, 0, SeparatorChange::Removed}};
+    }
+
+    // Clears the given record and puts it at the head of the available list.
+    void freeRecord(int recordNumber)
+    {
+        clearRecord(recordNumber);
+        unlinkLeaf(recordNumber);
+        markEmpty(recordNumber);
+        int empty = nextEmpty();
+        writeCell(recordNumber, 0, 1);
+        writeCell(empty, recordNumber, 1);
+        if (compaction.linking && recordNumber <= compaction.cursor) compaction.freed.insert(recordNumber);
+        count(&BTreeCounters::frees);
+    }
+
+    // Adds to the given counter of the statistics, if they are kept.
+    void count(atomic<long long> BTreeCounters::*counter, long long amount = 1)
+    {
+        if (counters) BTreeCounters::add((*counters).*counter, amount);
+    }
+
+    // Counts a node read or written for the operation running on this thread.
+    void countNode(atomic<long long> BTreeCounters::OperationCounters::*counter)
+    {
+        if (counters) BTreeCounters::add(counters->operations[countedOperation].*counter);
+    }
+};
+
+using BTree = BasicBTree<>;
+
+// One logical index partitioned across several b-tree files, the shards,
+// so that operations on different shards run in parallel and every shard
+// can live on its own disk. Keys are spread by a hash of the key, or by
+// ranges between split keys, which keeps each shard a contiguous part of the key order.
+// Every shard is a BasicBTree with the same options; use the index from several
+// threads at once only if the options are thread-safe.
+template <class Key = int, class Value = int, int Order = 0>
+class BasicShardedBTree {
+public:
+    using Tree = BasicBTree<Key, Value, Order>;
+    using Pair = typename Tree::Pair;
+    using Iterator = typename Tree::Iterator;
+
+private:
+    vector<unique_ptr<Tree>> shards;
+
+    // Shard i holds the keys not greater than splitKeys[i] and greater than the split key
+    // before it. Empty if the keys are spread by hash.
+    vector<Key> splitKeys;
+
+    // Runs the batch operations of the shards in parallel.
+    WorkerPool workers;
+
+    // Splits the pairs between the shards.
+    template <class InputIterator>
+    vector<vector<Pair>> partition(InputIterator first, InputIterator last)
+    {
+        vector<vector<Pair>> parts(shards.size());
+        for (; first != last; ++first) parts[shardOf(first->first)].emplace_back(first->first, first->second);
+        return parts;
+    }
+
+public:
+    // Opens a shard at each of the given paths, each with the given number of records,
+    // order and cell size. Keys are spread by hash unless split keys are given,
+    // one fewer than the paths, in ascending order. Batches run on the given number of threads,
+    // by default as many as there are shards or cores, whichever is fewer.
+    BasicShardedBTree(const vector<string>& paths, int numberOfRecords, int m, int cellSize,
+                      BTreeOptions options = {}, vector<Key> _splitKeys = {}, int threads = 0) :
+        splitKeys{move(_splitKeys)},
+        workers{threads > 0 ? threads : max(min((int) paths.size(), (int) thread::hardware_concurrency()), 1)}
+    {
+        if (paths.empty()) throw InvalidShards(0);
+        if (!splitKeys.empty() && (splitKeys.size() + 1 != paths.size() || !is_sorted(splitKeys.begin(), splitKeys.end())))
+            throw InvalidShards((int) paths.size());
+
+        shards.resize(paths.size());
+        workers.run((int) paths.size(), [&](int shard) {
+            shards[shard].reset(new Tree(paths[shard], numberOfRecords, m, cellSize, options));
+        });
+    }
+
+    // Returns the number of shards.
+    int shardCount() const { return (int) shards.size(); }
+
+    // Returns the shard with the given index.
+    Tree& shard(int index) { return *shards[index]; }
+
+    // Returns the index of the shard that holds the given key.
+    int shardOf(Key recordId) const
+    {
+        if (splitKeys.empty()) return (int) (mixKey((uint64_t) recordId) % shards.size());
+        return (int) (lower_bound(splitKeys.begin(), splitKeys.end(), recordId) - splitKeys.begin());
+    }
+
+    // Inserts a pair in its shard. Returns what BasicBTree::insert() returns.
+    int insert(Key recordId, Value reference)
+    {
+        return shards[shardOf(recordId)]->insert(recordId, reference);
+    }
+
+    // Returns the value of the given key, or -1 if it is not in its shard.
+    Value search(Key recordId)
+    {
+        return shards[shardOf(recordId)]->search(recordId);
+    }
+
+    void remove(Key recordId)
+    {
+        shards[shardOf(recordId)]->remove(recordId);
+    }
+
+    // Searches for every given key and returns their values in the same order,
+    // -1 for the keys not found. The keys of each shard are looked up in parallel.
+    vector<Value> searchMany(const Key* keys, size_t count)
+    {
+        vector<vector<Key>> parts(shards.size());
+        vector<vector<size_t>> positions(shards.size());
+        for (size_t i = 0; i < count; ++i)
+        {
+            int shard = shardOf(keys[i]);
+            parts[shard].push_back(keys[i]);
+            positions[shard].push_back(i);
+        }
+
+        vector<Value> values(count, -1);
+        workers.run((int) shards.size(), [&](int shard) {
+            vector<Value> found = shards[shard]->searchMany(parts[shard]);
+            for (size_t i = 0; i < found.size(); ++i) values[positions[shard][i]] = found[i];
+        });
+        return values;
+    }
+
+    vector<Value> searchMany(const vector<Key>& keys)
+    {
+        return searchMany(keys.data(), keys.size());
+    }
+
+    // Inserts a batch of pairs, the part of each shard in parallel.
+    // Returns the number of pairs inserted.
+    template <class InputIterator>
+    int insertBatch(InputIterator first, InputIterator last)
+    {
+        vector<vector<Pair>> parts = partition(first, last);
+        vector<int> inserted(shards.size());
+        workers.run((int) shards.size(), [&](int shard) {
+            if (!parts[shard].empty()) inserted[shard] = shards[shard]->insertBatch(parts[shard].begin(), parts[shard].end());
+        });
+        int total = 0;
+        for (int count: inserted) total += count;
+        return total;
+    }
+
+    // Replaces the contents of every shard with its part of the given pairs, in parallel.
+    // Returns false if a shard does not have enough records, leaving that shard untouched.
+    template <class InputIterator>
+    bool bulkLoad(InputIterator first, InputIterator last, double fillFactor = 1.0)
+    {
+        vector<vector<Pair>> parts = partition(first, last);
+        vector<char> loaded(shards.size());
+        workers.run((int) shards.size(), [&](int shard) {
+            loaded[shard] = shards[shard]->bulkLoad(parts[shard].begin(), parts[shard].end(), fillFactor);
+        });
+        return all_of(loaded.begin(), loaded.end(), [](char ok) { return ok; });
+    }
+
+    // Runs the given number of compaction steps on every shard, in parallel,
+    // or the rest of their compactions if steps is 0. Returns true once every shard has finished.
+    bool compact(int steps = 0, double fillFactor = 1.0)
+    {
+        vector<char> finished(shards.size());
+        workers.run((int) shards.size(), [&](int shard) { finished[shard] = shards[shard]->compact(steps, fillFactor); });
+        return all_of(finished.begin(), finished.end(), [](char done) { return done; });
+    }
+
+    // Writes the modified records of every shard to its file, in parallel.
+    void flush()
+    {
+        workers.run((int) shards.size(), [&](int shard) { shards[shard]->flush(); });
+    }
+
+    // Writes the modified records of every shard and blocks until the files reach the disk,
+    // syncing the shards in parallel.
+    void sync()
+    {
+        workers.run((int) shards.size(), [&](int shard) { shards[shard]->sync(); });
+    }
+
+    // The pairs with keys between lo and hi (inclusive) of every shard,
+    // merged into key order.
+    class ScanRange {
+    private:
+        vector<Iterator> heads;
+        Key hi;
+
+    public:
+        struct End {};
+
+        class Position {
+        private:
+            vector<Iterator> heads;
+            Key hi;
+
+            // The head with the smallest pair in the range, or -1 past the last one.
+            int current = -1;
+
+            void pick()
+            {
+                current = -1;
+                for (int i = 0; i < (int) heads.size(); ++i)
+                    if (heads[i].valid() && heads[i]->first <= hi && (current == -1 || *heads[i] < *heads[current]))
+                        current = i;
+            }
+
+        public:
+            Position(vector<Iterator> _heads, Key _hi) : heads{move(_heads)}, hi{_hi} { pick(); }
+            const Pair& operator*() const { return *heads[current]; }
+            Position& operator++() { ++heads[current]; pick(); return *this; }
+            bool operator!=(End) const { return current != -1; }
+        };
+
+        ScanRange(vector<Iterator> _heads, Key _hi) : heads{move(_heads)}, hi{_hi} {}
+        Position begin() const { return Position(heads, hi); }
+        End end() const { return End{}; }
+    };
+
+    // Returns the pairs with keys between lo and hi across the shards.
+    // Only the shards whose ranges overlap lo..hi are read when the keys are split by range.
+    ScanRange scan(Key lo, Key hi)
+    {
+        int first = 0, last = (int) shards.size() - 1;
+        if (!splitKeys.empty())
+        {
+            first = shardOf(lo);
+            last = shardOf(hi);
+        }
+
+        vector<Iterator> heads;
+        for (int shard = first; shard <= last; ++shard) heads.push_back(shards[shard]->lowerBound(lo));
+        return ScanRange(move(heads), hi);
+    }
+};
+
+using ShardedBTree = BasicShardedBTree<>;
+
+// Construction-time options of an index build over a data file.
+struct IndexBuildOptions {
+    // The size in bytes of every record of the data file,
+    // or 0 if every record ends with the delimiter instead.
+    int recordSize = 0;
+
+    // The byte that ends every record when recordSize is 0.
+    char delimiter = '\n';
+
+    // The number of bytes read from the data file at once.
+    // The next block is read while the records of the current one are parsed.
+    int blockBytes = 8 << 20;
+
+    // The number of threads that parse the records of a block, 0 for one per core.
+    int threads = 0;
+};
+
+// The progress of an index build over a data file.
+struct IndexBuildStatistics {
+    // The bytes of the data file read so far.
+    long long bytes = 0;
+
+    // The records whose recordId was extracted, and those without one.
+    long long records = 0, skipped = 0;
+
+    // The time since the first read, up to the end of the data file
+    // or, after build(), up to the end of the bulk load.
+    double seconds = 0;
+
+    // Returns the bytes read per second, in megabytes of 10^6 bytes.
+    double megabytesPerSecond() const { return seconds > 0 ? bytes / 1e6 / seconds : 0; }
+
+    string toJson() const
+    {
+        ostringstream out;
+        out << "{\"bytes\": " << bytes
+            << ", \"records\": " << records
+            << ", \"skipped\": " << skipped
+            << ", \"seconds\": " << seconds
+            << ", \"megabytesPerSecond\": " << megabytesPerSecond() << "}";
+        return out.str();
+    }
+};
+
+// Extracts the (recordId, byteOffset) pairs of the records of a data file,
+// the references a b-tree over the file needs. The file is read in blocks cut at
+// record boundaries, each on a thread of its own while the block before it is parsed,
+// and the records of a block are parsed in chunks on a pool of threads.
+// The pairs come out in file order as a single-pass range, which bulkLoad() sorts
+// in runs as it goes, so a data file of any size is indexed in bounded memory.
+template <class Key = int, class Value = int>
+class BasicIndexBuilder {
+public:
+    using Pair = pair<Key, Value>;
+
+    // Finds the recordId in the size bytes of a record, returning false if it has none.
+    using KeyExtractor = function<bool(const char* record, int size, Key& key)>;
+
+    // Reads the integer at the start of a record, after any spaces: the first field
+    // of a line like "42,..." or of a fixed record padded like a text cell.
+    static bool leadingInteger(const char* record, int size, Key& key)
+    {
+        int i = 0;
+        while (i < size && record[i] == ' ') ++i;
+        return from_chars(record + i, record + size, key).ec == errc();
+    }
+
+private:
+    string path;
+    IndexBuildOptions options;
+    KeyExtractor extract;
+    ifstream file;
+
+    // Parses the chunks of a block in parallel.
+    WorkerPool workers;
+
+    IndexBuildStatistics progress;
+    chrono::steady_clock::time_point start;
+    bool started = false, finished = false;
+
+    // The block being parsed and the block read ahead of it, both cut at a record boundary,
+    // with the offsets of their first bytes in the data file.
+    vector<char> current, ahead;
+    long long currentOffset = 0, aheadOffset = 0;
+
+    // The bytes read after the last cut, which start the next block,
+    // and the offset of the next byte of the data file to read.
+    vector<char> carry;
+    long long nextOffset = 0;
+    bool exhausted = false;
+
+    // Reads the next block into ahead while the current one is parsed.
+    thread reader;
+
+    // The pairs of every chunk of the current block, and the pair the pass is at.
+    vector<vector<Pair>> chunks;
+    vector<long long> chunkSkipped;
+    size_t chunk = 0, index = 0;
+
+    // Returns the number of bytes of the given block up to its last whole record.
+    size_t recordEnd(const vector<char>& block) const
+    {
+        if (options.recordSize > 0) return block.size() / options.recordSize * options.recordSize;
+        auto last = find(block.rbegin(), block.rend(), options.delimiter);
+        return (size_t) (block.rend() - last);
+    }
+
+    // Reads the next block into ahead: the carried bytes and at least blockBytes more,
+    // cut after the last whole record. The last block takes the rest of the data file.
+    void readAhead()
+    {
+        ahead.swap(carry);
+        aheadOffset = nextOffset - (long long) ahead.size();
+        size_t cut = 0;
+        while (cut == 0 && !exhausted)
+        {
+            size_t size = ahead.size();
+            ahead.resize(size + options.blockBytes);
+            file.read(ahead.data() + size, options.blockBytes);
+            size_t count = (size_t) file.gcount();
+            ahead.resize(size + count);
+            nextOffset += (long long) count;
+            exhausted = count < (size_t) options.blockBytes;
+            cut = exhausted ? ahead.size() : recordEnd(ahead);
+        }
+        carry.assign(ahead.begin() + cut, ahead.end());
+        ahead.resize(cut);
+    }
+
+    // Splits the current block into a chunk per thread at record boundaries,
+    // and extracts the pairs of the chunks in parallel.
+    void parse()
+    {
+        int parts = (int) chunks.size();
+        const char* data = current.data();
+        size_t size = current.size();
+        vector<size_t> bounds(parts + 1, size);
+        bounds[0] = 0;
+        for (int k = 1; k < parts; ++k)
+        {
+            size_t at = max(bounds[k - 1], size / parts * k);
+            if (options.recordSize > 0) at = (at + options.recordSize - 1) / options.recordSize * options.recordSize;
+            else if (at > 0)
+            {
+                // A record starts after the delimiter of the record that holds the byte before it
+                auto end = (const char*) memchr(data + at - 1, options.delimiter, size - (at - 1));
+                at = end ? end - data + 1 : size;
+            }
+            bounds[k] = min(at, size);
+        }
+
+        workers.run(parts, [&](int k) {
+            vector<Pair>& pairs = chunks[k];
+            pairs.clear();
+            long long skipped = 0;
+            for (size_t p = bounds[k]; p < bounds[k + 1];)
+            {
+                size_t length = bounds[k + 1] - p, next;
+                if (options.recordSize > 0)
+                {
+                    length = min(length, (size_t) options.recordSize);
+                    next = p + length;
+                }
+                else
+                {
+                    auto end = (const char*) memchr(data + p, options.delimiter, length);
+                    if (end) length = end - (data + p);
+                    next = p + length + 1;
+                }
+
+                Key key;
+                if (extract(data + p, (int) length, key))
+                {
+                    long long offset = currentOffset + (long long) p;
+                    if (offset > (long long) numeric_limits<Value>::max()) throw InvalidOffset(offset);
+                    pairs.emplace_back(key, (Value) offset);
+                }
+                else ++skipped;
+                p = next;
+            }
+            chunkSkipped[k] = skipped;
+        });
+
+        for (int k = 0; k < parts; ++k)
+        {
+            progress.records += (long long) chunks[k].size();
+            progress.skipped += chunkSkipped[k];
+        }
+    }
+
+    // Parses the block read ahead and starts reading the one after it, until a block
+    // has pairs. Returns false at the end of the data file.
+    bool nextBlock()
+    {
+        while (true)
+        {
+            if (reader.joinable()) reader.join();
+            swap(current, ahead);
+            currentOffset = aheadOffset;
+            ahead.clear();
+            if (current.empty())
+            {
+                finished = true;
+                progress.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                return false;
+            }
+
+            progress.bytes += (long long) current.size();
+            if (!exhausted) reader = thread([this] { readAhead(); });
+            parse();
+            for (chunk = 0, index = 0; chunk < chunks.size(); ++chunk)
+                if (!chunks[chunk].empty()) return true;
+        }
+    }
+
+    // Moves to the next pair, returning false at the end of the data file.
+    bool step()
+    {
+        if (++index < chunks[chunk].size()) return true;
+        index = 0;
+        while (++chunk < chunks.size())
+            if (!chunks[chunk].empty()) return true;
+        return nextBlock();
+    }
+
+public:
+    // Opens the data file at the given path. Records in which the given extractor
+    // finds no recordId are skipped.
+    explicit BasicIndexBuilder(string _path, IndexBuildOptions _options = {}, KeyExtractor _extract = leadingInteger) :
+        path{move(_path)},
+        options{_options},
+        extract{move(_extract)},
+        workers{options.threads > 0 ? options.threads : max((int) thread::hardware_concurrency(), 1)}
+    {
+        options.recordSize = max(options.recordSize, 0);
+        options.blockBytes = max(options.blockBytes, 1);
+        file.open(path, ios::binary);
+        if (!file.is_open()) throw UnsupportedStorage(path);
+
+        int threads = options.threads > 0 ? options.threads : max((int) thread::hardware_concurrency(), 1);
+        chunks.resize(threads);
+        chunkSkipped.resize(threads);
+    }
+
+    ~BasicIndexBuilder()
+    {
+        if (reader.joinable()) reader.join();
+    }
+
+    BasicIndexBuilder(const BasicIndexBuilder&) = delete;
+    BasicIndexBuilder& operator=(const BasicIndexBuilder&) = delete;
+
+    // The position of a pair in the pass over the data file.
+    class Position {
+    private:
+        // Null at the end of the data file.
+        BasicIndexBuilder* builder;
+
+    public:
+        explicit Position(BasicIndexBuilder* _builder) : builder{_builder} {}
+
+        const Pair& operator*() const { return builder->chunks[builder->chunk][builder->index]; }
+        const Pair* operator->() const { return &**this; }
+
+        Position& operator++()
+        {
+            if (!builder->step()) builder = nullptr;
+            return *this;
+        }
+
+        bool operator==(const Position& other) const { return builder == other.builder; }
+        bool operator!=(const Position& other) const { return builder != other.builder; }
+    };
+
+    // Starts the pass over the data file, which can be made once:
+    // a later call returns the position the pass is at.
+    Position begin()
+    {
+        if (!started)
+        {
+            started = true;
+            start = chrono::steady_clock::now();
+            readAhead();
+            nextBlock();
+        }
+        return Position(finished ? nullptr : this);
+    }
+
+    Position end() { return Position(nullptr); }
+
+    // Replaces the contents of the given b-tree, sharded or not, with the pairs
+    // of the data file, packing its nodes to the given fill factor.
+    // Returns false, leaving the b-tree untouched, if it does not have enough records.
+    template <class Index>
+    bool build(Index& index, double fillFactor = 1.0)
+    {
+        bool loaded = index.bulkLoad(begin(), end(), fillFactor);
+        progress.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return loaded;
+    }
+
+    // Returns the bytes and records read so far, and the throughput.
+    const IndexBuildStatistics& statistics() const { return progress; }
+};
+
+using IndexBuilder = BasicIndexBuilder<>;
+
+#endif